@@ -0,0 +1,190 @@
+/* The Computer Language Benchmarks Game
+ * https://salsa.debian.org/benchmarksgame-team/benchmarksgame/
+
+   binary_trees.c with the depth iterations spread over pthreads:
+   every depth is a work item taken by the first free worker, results
+   are printed in depth order, so the output does not depend on the
+   number of threads.
+
+   usage: binary_trees_parallel <max depth> [threads, default 4]
+*/
+
+#include <malloc.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+
+#define MAX_THREADS 64
+#define MAX_DEPTHS  64
+
+
+typedef struct tn {
+    struct tn*    left;
+    struct tn*    right;
+} treeNode;
+
+
+treeNode* NewTreeNode(treeNode* left, treeNode* right)
+{
+    treeNode*    new;
+
+    new = (treeNode*)malloc(sizeof(treeNode));
+
+    new->left = left;
+    new->right = right;
+
+    return new;
+} /* NewTreeNode() */
+
+
+long ItemCheck(treeNode* tree)
+{
+    if (tree->left == NULL)
+        return 1;
+    else
+        return 1 + ItemCheck(tree->left) + ItemCheck(tree->right);
+} /* ItemCheck() */
+
+
+treeNode* BottomUpTree(unsigned depth)
+{
+    if (depth > 0)
+        return NewTreeNode
+        (
+            BottomUpTree(depth - 1),
+            BottomUpTree(depth - 1)
+        );
+    else
+        return NewTreeNode(NULL, NULL);
+} /* BottomUpTree() */
+
+
+void DeleteTree(treeNode* tree)
+{
+    if (tree->left != NULL)
+    {
+        DeleteTree(tree->left);
+        DeleteTree(tree->right);
+    }
+
+    free(tree);
+} /* DeleteTree() */
+
+
+typedef struct {
+    unsigned   minDepth, maxDepth;
+    unsigned   nextDepth;           /* next depth to take, under lock */
+    pthread_mutex_t lock;
+    long       iterations[MAX_DEPTHS];
+    long       check[MAX_DEPTHS];
+} work;
+
+
+/* thread entry: takes depths until none are left */
+void* Worker(void* arg)
+{
+    work*      w = (work*)arg;
+    unsigned   depth;
+
+    for (;;)
+    {
+        long    i, iterations, check;
+
+        pthread_mutex_lock(&w->lock);
+        depth = w->nextDepth;
+        w->nextDepth += 2;
+        pthread_mutex_unlock(&w->lock);
+        if (depth > w->maxDepth)
+            break;
+
+        iterations = pow(2, w->maxDepth - depth + w->minDepth);
+
+        check = 0;
+
+        for (i = 1; i <= iterations; i++)
+        {
+            treeNode*   tempTree = BottomUpTree(depth);
+            check += ItemCheck(tempTree);
+            DeleteTree(tempTree);
+        } /* for(i = 1...) */
+
+        w->iterations[depth] = iterations;
+        w->check[depth] = check;
+    }
+
+    return NULL;
+} /* Worker() */
+
+
+int main(int argc, char* argv[])
+{
+    unsigned   N, depth, minDepth, maxDepth, stretchDepth, nThreads, t;
+    treeNode   *stretchTree, *longLivedTree;
+    pthread_t  threads[MAX_THREADS];
+    work       w;
+
+    N = atol(argv[1]);
+    nThreads = argc > 2 ? atol(argv[2]) : 4;
+    if (nThreads < 1)
+        nThreads = 1;
+    if (nThreads > MAX_THREADS)
+        nThreads = MAX_THREADS;
+
+    minDepth = 4;
+
+    if ((minDepth + 2) > N)
+        maxDepth = minDepth + 2;
+    else
+        maxDepth = N;
+    if (maxDepth >= MAX_DEPTHS - 1)
+        maxDepth = MAX_DEPTHS - 2;
+
+    stretchDepth = maxDepth + 1;
+
+    stretchTree = BottomUpTree(stretchDepth);
+    printf
+    (
+        "stretch tree of depth %u\t check: %li\n",
+        stretchDepth,
+        ItemCheck(stretchTree)
+    );
+
+    DeleteTree(stretchTree);
+
+    longLivedTree = BottomUpTree(maxDepth);
+
+    w.minDepth = minDepth;
+    w.maxDepth = maxDepth;
+    w.nextDepth = minDepth;
+    pthread_mutex_init(&w.lock, NULL);
+
+    for (t = 0; t < nThreads; t++)
+        if (pthread_create(&threads[t], NULL, Worker, &w) != 0)
+        {
+            perror("pthread_create");
+            return 1;
+        }
+    for (t = 0; t < nThreads; t++)
+        pthread_join(threads[t], NULL);
+
+    for (depth = minDepth; depth <= maxDepth; depth += 2)
+        printf
+        (
+            "%li\t trees of depth %u\t check: %li\n",
+            w.iterations[depth],
+            depth,
+            w.check[depth]
+        );
+
+    printf
+    (
+        "long lived tree of depth %u\t check: %li\n",
+        maxDepth,
+        ItemCheck(longLivedTree)
+    );
+
+    pthread_mutex_destroy(&w.lock);
+    return 0;
+} /* main() */
@@ -0,0 +1,293 @@
+#ifndef CALLEE_AVAILABILITY_H
+#define CALLEE_AVAILABILITY_H
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/BitVector.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Instructions.h"
+
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+/*
+    \brief   Множество "объявленных" вызываемых функций с областями
+             видимости, соответствующими поддеревьям дерева доминаторов.
+    \details Каждой функции заранее выдается плотный индекс, поэтому
+             множество хранится как битовый вектор. Все изменения
+             записываются в один общий журнал отката, открытие и
+             закрытие области видимости стоит O(1) (плюс число
+             откатываемых записей).
+*/
+class ScopedAvailability
+{
+    public:
+    using CalleeId = unsigned;
+
+    /*
+        \brief  Сбрасывает состояние и готовит множество на n_callees
+                функций.
+    */
+    void reset(unsigned n_callees)
+    {
+        m_declared.clear();
+        m_declared.resize(n_callees);
+        m_undo_log.clear();
+        m_scopes.clear();
+    }
+
+    /*
+        \brief  Открывает область видимости для узла дерева на глубине level.
+    */
+    void push_scope(unsigned level)
+    {
+        m_scopes.push_back({level, static_cast<unsigned>(m_undo_log.size())});
+    }
+
+    /*
+        \brief  Закрывает все области видимости с глубиной не меньше level,
+                т.е. все, что не является предками узла на глубине level.
+    */
+    void pop_to(unsigned level)
+    {
+        while(!m_scopes.empty() && m_scopes.back().first >= level)
+        {
+            unsigned mark = m_scopes.back().second;
+            while(m_undo_log.size() > mark)
+            {
+                m_declared.reset(m_undo_log.back());
+                m_undo_log.pop_back();
+            }
+            m_scopes.pop_back();
+        }
+    }
+
+    bool is_declared(CalleeId id) const { return m_declared.test(id); }
+
+    /*
+        \brief  Помечает функцию объявленной в текущей области видимости.
+        \return true, если функция ранее не была объявлена.
+    */
+    bool declare(CalleeId id)
+    {
+        if(m_declared.test(id))
+            return false;
+        m_declared.set(id);
+        m_undo_log.push_back(id);
+        return true;
+    }
+
+    private:
+    llvm::BitVector m_declared;
+    std::vector<CalleeId> m_undo_log;
+    /* пары {глубина узла, размер журнала при открытии области} */
+    std::vector<std::pair<unsigned, unsigned>> m_scopes;
+};
+
+/*
+    \brief   Множество "объявленных" функций по интервалам DFS-нумерации
+             дерева доминаторов.
+    \details Для каждой функции хранятся отсортированные интервалы
+             [in, out] самых верхних блоков, в которых она объявляется.
+             Поддеревья дерева доминаторов либо вложены, либо не
+             пересекаются, поэтому вложенные интервалы отбрасываются, а
+             вопрос "объявлена ли функция в строгом доминаторе блока"
+             решается бинарным поиском. Областей видимости и журнала
+             отката нет, блоки можно обходить в любом порядке.
+*/
+class DominanceIntervals
+{
+    public:
+    using CalleeId = ScopedAvailability::CalleeId;
+
+    /*
+        \brief  Сбрасывает состояние и готовит множество на n_callees
+                функций.
+    */
+    void reset(unsigned n_callees)
+    {
+        m_intervals.clear();
+        m_intervals.resize(n_callees);
+        m_seen.assign(n_callees, 0);
+        m_stamp = 0;
+    }
+
+    /*
+        \brief  Регистрирует блок с номерами in/out, объявляющий функцию.
+        \note   Блоки добавляются в порядке возрастания in.
+    */
+    void add(CalleeId id, unsigned in, unsigned out)
+    {
+        auto& intervals = m_intervals[id];
+        // блок в поддереве уже добавленного блока ничего не меняет
+        if(intervals.empty() || intervals.back().second < out)
+            intervals.push_back({in, out});
+    }
+
+    /*
+        \brief  Делает текущим блок с номерами in/out.
+    */
+    void enter_block(unsigned in, unsigned out)
+    {
+        m_in = in;
+        m_out = out;
+        m_stamp++;
+    }
+
+    /*
+        \brief  Помечает функцию объявленной в текущем блоке.
+        \return true, если функция не объявлена ни в строгом доминаторе
+                текущего блока, ни ранее в самом блоке.
+    */
+    bool declare(CalleeId id)
+    {
+        if(m_seen[id] == m_stamp)
+            return false;
+        m_seen[id] = m_stamp;
+        const auto& intervals = m_intervals[id];
+        // последний интервал, начинающийся не позже текущего блока
+        auto it = std::upper_bound(intervals.begin(), intervals.end(), m_in,
+                                   [](unsigned in, const std::pair<unsigned, unsigned>& interval) {
+                                       return in < interval.first;
+                                   });
+        if(it == intervals.begin())
+            return true;
+        --it;
+        return it->first == m_in || it->second < m_out;
+    }
+
+    private:
+    /* для каждой функции - интервалы {in, out} самых верхних блоков */
+    std::vector<llvm::SmallVector<std::pair<unsigned, unsigned>, 2>> m_intervals;
+    /* номер блока, в котором функция последний раз объявлялась */
+    std::vector<unsigned> m_seen;
+    unsigned m_stamp = 0;
+    unsigned m_in = 0;
+    unsigned m_out = 0;
+};
+
+/*
+    \brief   Таблица мест вызова функции, собранная за один проход.
+    \details Для каждого базового блока хранится непрерывный диапазон
+             вызовов с плотными индексами вызываемых функций. Блоки без
+             вызовов в таблицу не попадают и могут пропускаться при обходе.
+*/
+class CallSiteTable
+{
+    public:
+    using CalleeId = ScopedAvailability::CalleeId;
+
+    struct CallSite
+    {
+        llvm::CallBase* call;
+        CalleeId callee;
+    };
+
+    /*
+        \brief  Собирает вызовы функции F.
+        \param  [in]  skip      Функции, вызовы которых не учитываются (может быть nullptr)
+        \param  [in]  tag_kind  Вид метаданных, которыми помечены уже вставленные
+                                последовательности; такие инструкции собираются в
+                                tagged() (0 - не собирать)
+        \param  [in]  covered   Вызовы, которые уже обслуживают эти последовательности;
+                                не учитываются (может быть nullptr)
+    */
+    void scan(llvm::Function& F, const llvm::DenseSet<const llvm::Function*>* skip = nullptr,
+              unsigned tag_kind = 0, const llvm::DenseSet<const llvm::Instruction*>* covered = nullptr)
+    {
+        m_n_skipped = 0;
+        m_n_covered = 0;
+        m_ids.clear();
+        m_callees.clear();
+        m_calls.clear();
+        m_blocks.clear();
+        m_tagged.clear();
+        for(llvm::BasicBlock& BB : F)
+        {
+            unsigned begin = m_calls.size();
+            for(llvm::Instruction& I : BB)
+            {
+                if(tag_kind && I.hasMetadataOtherThanDebugLoc() && I.getMetadata(tag_kind))
+                    m_tagged.push_back(&I);
+                /* call, invoke и callbr; у callbr вызывается только ассемблер */
+                auto CB = llvm::dyn_cast<llvm::CallBase>(&I);
+                if(!CB || CB->isInlineAsm())
+                    continue;
+                /* косвенные вызовы различаются по значению указателя на функцию,
+                   вызовы через bitcast - по самой функции */
+                llvm::Value* callee = CB->getCalledOperand()->stripPointerCasts();
+                auto callee_fn = llvm::dyn_cast<llvm::Function>(callee);
+                if(callee_fn && callee_fn->isIntrinsic())
+                    continue;
+                if(skip && callee_fn && skip->count(callee_fn))
+                {
+                    m_n_skipped++;
+                    continue;
+                }
+                if(covered && covered->count(CB))
+                {
+                    m_n_covered++;
+                    continue;
+                }
+                auto it = m_ids.insert({callee, m_ids.size()});
+                if(it.second)
+                    m_callees.push_back(callee);
+                m_calls.push_back({CB, it.first->second});
+            }
+            if(m_calls.size() != begin)
+                m_blocks[&BB] = {begin, static_cast<unsigned>(m_calls.size())};
+        }
+    }
+
+    unsigned num_callees() const { return m_ids.size(); }
+
+    unsigned num_calls() const { return m_calls.size(); }
+
+    /* число вызовов, пропущенных из-за skip */
+    unsigned num_skipped() const { return m_n_skipped; }
+
+    /* число вызовов, пропущенных из-за covered */
+    unsigned num_covered() const { return m_n_covered; }
+
+    /* инструкции с метаданными tag_kind в порядке обхода функции */
+    llvm::ArrayRef<llvm::Instruction*> tagged() const { return m_tagged; }
+
+    llvm::Value* callee(CalleeId id) const { return m_callees[id]; }
+
+    /* индекс функции; false - в функции нет ее вызовов */
+    bool find(const llvm::Value* callee, CalleeId& id) const
+    {
+        auto it = m_ids.find(callee);
+        if(it == m_ids.end())
+            return false;
+        id = it->second;
+        return true;
+    }
+
+    bool has_calls(const llvm::BasicBlock* BB) const { return m_blocks.count(BB); }
+
+    /*
+        \brief  Вызовы внутри блока в порядке следования инструкций.
+    */
+    llvm::ArrayRef<CallSite> calls(const llvm::BasicBlock* BB) const
+    {
+        auto it = m_blocks.find(BB);
+        if(it == m_blocks.end())
+            return {};
+        return llvm::makeArrayRef(m_calls).slice(it->second.first, it->second.second - it->second.first);
+    }
+
+    private:
+    llvm::DenseMap<const llvm::Value*, CalleeId> m_ids;
+    std::vector<llvm::Value*> m_callees;
+    std::vector<CallSite> m_calls;
+    llvm::DenseMap<const llvm::BasicBlock*, std::pair<unsigned, unsigned>> m_blocks;
+    std::vector<llvm::Instruction*> m_tagged;
+    unsigned m_n_skipped = 0;
+    unsigned m_n_covered = 0;
+};
+
+#endif // CALLEE_AVAILABILITY_H
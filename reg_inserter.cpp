@@ -1,33 +1,362 @@
 #include "llvm/Pass.h"
+#include "llvm/InitializePasses.h"
+#include "llvm/IR/DiagnosticInfo.h"
 #include "llvm/IR/Function.h"
+#include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/Instructions.h"
 #include "llvm/IR/InlineAsm.h"
 #include "llvm/IR/IntrinsicInst.h"
 #include "llvm/IR/Intrinsics.h"
 #include "llvm/Support/raw_ostream.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/TimeProfiler.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/ADT/Triple.h"
+#include "llvm/Analysis/OptimizationRemarkEmitter.h"
 
 #include "llvm/IR/LegacyPassManager.h"
 #include "llvm/Transforms/IPO/PassManagerBuilder.h"
+#include "llvm/Transforms/Utils/Local.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Passes/PassPlugin.h"
 
 #include "llvm/IR/Dominators.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/BlockFrequencyInfo.h"
+#include "llvm/Analysis/CallGraph.h"
+#include "llvm/ADT/DepthFirstIterator.h"
+#include "llvm/ADT/SCCIterator.h"
+#include "llvm/ADT/SmallPtrSet.h"
 #include "llvm/ADT/GraphTraits.h"
 #include "llvm/Support/GenericDomTree.h"
 
-#include <set>
-#include <stack>
+#include <climits>
 #include <iostream>
 
+#include "reg_inserter.h"
+#include "callee_availability.h"
+#include "result_cache.h"
+#include "site_profile.h"
+
 using namespace llvm;
 
-#define STACK_IMP 0
-#define DFS_IMP 1
-#define ALGORITHM STACK_IMP
+#define DEBUG_TYPE "reg-inserter"
+
+STATISTIC(NumFunctions, "Number of functions visited");
+STATISTIC(NumCalls, "Number of call sites seen");
+STATISTIC(NumInserted, "Number of register sequences inserted");
+STATISTIC(NumElided, "Number of calls elided as already declared");
+STATISTIC(NumMerged, "Number of calls sharing the sequence of a previous call");
+STATISTIC(NumHoisted, "Number of sequences placed away from a call site");
+STATISTIC(NumElidedClean, "Number of calls skipped because the callee never observes x28");
+STATISTIC(NumCacheHits, "Number of functions replayed from the result cache");
+STATISTIC(NumCacheMisses, "Number of functions traversed and added to the result cache");
+STATISTIC(NumSkippedInstrumented, "Number of functions skipped as already instrumented");
+STATISTIC(NumCovered, "Number of calls served by sequences inserted by an earlier run");
+STATISTIC(NumCounted, "Number of sequences counted by -reg-inserter-counters");
+STATISTIC(NumProfileCold, "Number of calls kept at their sequence because the profile never executed it");
+STATISTIC(NumCleanupOrphaned, "Number of sequences deleted by the cleanup: no call to their callees is left");
+STATISTIC(NumCleanupRedundant, "Number of sequences deleted by the cleanup: dominated by a sequence or call for the same callees");
+
+cl::opt<TraversalAlgorithm> RegInserterAlgorithm(
+    "reg-inserter-algorithm",
+    cl::desc("Dominator tree traversal used to find the first calls"),
+    cl::values(
+        clEnumValN(STACK_IMP, "stack", "iterative DFS with scoped availability"),
+        clEnumValN(DFS_IMP, "dfs", "recursive DFS with scoped availability"),
+        clEnumValN(INTERVAL_IMP, "interval",
+                   "binary search over dominator tree DFS intervals of each callee")),
+    cl::init(ALGORITHM));
+
+cl::opt<bool> RegInserterCoalesce(
+    "reg-inserter-coalesce",
+    cl::desc("Share one register sequence between consecutive first calls "
+             "in a basic block"),
+    cl::init(false));
+
+static cl::opt<std::string> RegInserterRegister(
+    "reg-inserter-register",
+    cl::desc("Register that holds the chain pointer (default: x28 on AArch64, "
+             "x27 on RISC-V); the program must be built with it reserved"),
+    cl::value_desc("name"));
+
+cl::opt<ChainLowering> RegInserterLowering(
+    "reg-inserter-lowering",
+    cl::desc("Where the chain pointer is kept"),
+    cl::values(
+        clEnumValN(REGISTER_LOWERING, "register",
+                   "reserved register (-reg-inserter-register), the program is "
+                   "built with it reserved"),
+        clEnumValN(THREAD_LOCAL_LOWERING, "thread-local",
+                   "thread_local global __reg_inserter_chain"),
+        clEnumValN(GLOBAL_LOWERING, "global", "plain global __reg_inserter_chain")),
+    cl::init(REGISTER_LOWERING));
+
+static cl::opt<bool> RegInserterHoistLoops(
+    "reg-inserter-hoist-loops",
+    cl::desc("Hoist the sequence of a callee called on every loop iteration "
+             "into the loop preheader"),
+    cl::init(false));
+
+static cl::opt<bool> RegInserterFrequencyPlacement(
+    "reg-inserter-frequency-placement",
+    cl::desc("Place sequences at the dominating blocks with the lowest total "
+             "estimated (or profiled) frequency; overrides hoisting"),
+    cl::init(false));
+
+static cl::list<std::string> RegInserterThreadEntries(
+    "reg-inserter-thread-entry",
+    cl::desc("Functions that start a thread and set up their own chain, in addition "
+             "to pthread_create start routines and functions annotated with "
+             "__attribute__((annotate(\"reg_inserter.thread_entry\")))"),
+    cl::value_desc("name"), cl::CommaSeparated);
+
+cl::opt<std::string> RegInserterCacheDir(
+    "reg-inserter-cache-dir",
+    cl::desc("Directory of the on-disk per-function result cache: functions whose "
+             "IR and pass options did not change replay the recorded insertion "
+             "points without the dominator tree traversal (no remarks are emitted "
+             "for them)"),
+    cl::value_desc("directory"));
+
+// место прохода в стандартном конвейере -O (clang -Xclang -load или
+// -fpass-plugin): чем позже, тем меньше вставленные интринсики мешают
+// встраиванию, LICM, GVN и SimplifyCFG и тем меньше последовательностей
+// остается перед вызовами, которые потом встроятся
+enum ExtensionPoint { EARLY_EP, SCALAR_LATE_EP, OPTIMIZER_LAST_EP };
+
+static cl::opt<ExtensionPoint> RegInserterEP(
+    "reg-inserter-ep",
+    cl::desc("Where the pass is added to the standard optimization pipeline"),
+    cl::values(
+        clEnumValN(EARLY_EP, "early",
+                   "EP_EarlyAsPossible / PipelineStartEP, before inlining"),
+        clEnumValN(SCALAR_LATE_EP, "scalar-late",
+                   "EP_ScalarOptimizerLate / ScalarOptimizerLateEP, after the "
+                   "function simplification pipeline"),
+        clEnumValN(OPTIMIZER_LAST_EP, "optimizer-last",
+                   "EP_OptimizerLast / OptimizerLastEP, at the end of the pipeline")),
+    cl::init(EARLY_EP));
+
+static cl::opt<bool> RegInserterRunCleanup(
+    "reg-inserter-cleanup",
+    cl::desc("Add reg_inserter_cleanup at the end of the standard optimization "
+             "pipeline: deletes sequences whose calls were inlined or removed and "
+             "sequences dominated by another one for the same callee"),
+    cl::init(false));
+
+static cl::opt<bool> RegInserterCounters(
+    "reg-inserter-counters",
+    cl::desc("Count executions of every inserted sequence (before a call, hoisted or "
+             "placed in a dominating block); a program linked with reg_inserter_rt.c "
+             "appends the counters to a profile at exit"),
+    cl::init(false));
+
+static cl::opt<std::string> RegInserterProfile(
+    "reg-inserter-profile",
+    cl::desc("Profile of a -reg-inserter-counters build: a call whose sequence never "
+             "ran keeps it at the call instead of having it hoisted into a loop "
+             "preheader or placed in a dominating block"),
+    cl::value_desc("file"));
+
+static cl::opt<unsigned> RegInserterProfileTop(
+    "reg-inserter-profile-top",
+    cl::desc("Number of the hottest sites of -reg-inserter-profile printed to stderr"),
+    cl::init(10));
+
+static cl::opt<bool> RegInserterReport(
+    "reg-inserter-report",
+    cl::desc("Print per-function RegInserter counters to stderr"),
+    cl::init(false));
+
+// точка входа потока: функция передана в pthread_create, помечена
+// аннотацией reg_inserter.thread_entry или перечислена в
+// -reg-inserter-thread-entry. Смотрятся только использования самой
+// функции, поэтому проходу по функциям не нужно менять или обходить модуль
+static bool starts_thread(const Function& F)
+{
+  for (const std::string& name : RegInserterThreadEntries)
+    if (F.getName() == name)
+      return true;
+  // вызов через bitcast и элемент llvm.global.annotations - пользователи
+  // константных выражений
+  SmallVector<const User*, 8> users(F.users());
+  for (size_t i = 0; i < users.size(); i++) {
+    const User* U = users[i];
+    if (isa<ConstantExpr>(U)) {
+      users.append(U->user_begin(), U->user_end());
+      continue;
+    }
+    if (auto CB = dyn_cast<CallBase>(U)) {
+      auto callee = dyn_cast<Function>(CB->getCalledOperand()->stripPointerCasts());
+      if (callee && callee->getName() == "pthread_create" && CB->arg_size() > 2 &&
+          CB->getArgOperand(2)->stripPointerCasts() == &F)
+        return true;
+      continue;
+    }
+    // элементы llvm.global.annotations: {функция, строка аннотации, файл, строка, ...}
+    auto entry = dyn_cast<ConstantStruct>(U);
+    if (!entry || entry->getNumOperands() < 2 || entry->getOperand(0)->stripPointerCasts() != &F)
+      continue;
+    auto str = dyn_cast<GlobalVariable>(entry->getOperand(1)->stripPointerCasts());
+    auto data = str && str->hasInitializer() ? dyn_cast<ConstantDataArray>(str->getInitializer()) : nullptr;
+    if (!data || !data->isCString() || data->getAsCString() != reg_inserter_thread_entry)
+      continue;
+    for (const User* list : entry->users())
+      for (const User* annotations : list->users())
+        if (auto GV = dyn_cast<GlobalVariable>(annotations))
+          if (GV->getName() == "llvm.global.annotations")
+            return true;
+  }
+  return false;
+}
+
+bool mark_thread_entries(Module& M)
+{
+  bool changed = false;
+  for (Function& F : M)
+    if (!F.hasFnAttribute(reg_inserter_thread_entry) && starts_thread(F)) {
+      F.addFnAttr(reg_inserter_thread_entry);
+      changed = true;
+    }
+  return changed;
+}
+
+bool is_thread_entry(const Function& F)
+{
+  return F.hasFnAttribute(reg_inserter_thread_entry) || starts_thread(F);
+}
+
+// регистр цепочки: из -reg-inserter-register или по умолчанию для платформы;
+// пустая строка - бэкенд платформы не умеет резервировать регистр общего
+// назначения для llvm.read_register (x86-64 допускает только rsp и rbp)
+StringRef reserved_register(const Module& M)
+{
+  if (!RegInserterRegister.empty())
+    return RegInserterRegister;
+  switch (Triple(M.getTargetTriple()).getArch()) {
+  case Triple::aarch64:
+  case Triple::aarch64_be:
+  case Triple::aarch64_32:
+    return "x28";
+  case Triple::riscv32:
+  case Triple::riscv64:
+    return "x27";
+  // модули без triple (например, из тестов) - как раньше
+  case Triple::UnknownArch:
+    return "x28";
+  default:
+    return "";
+  }
+}
+
+// регистр цепочки и объявления, общие для всех функций модуля: находятся
+// при первой функции модуля, которой они нужны, и хранятся в объекте
+// прохода, а не ищутся в каждой функции заново
+struct RegInserterModuleInfo
+{
+  const Module* M = nullptr;
+  StringRef reg;
+  // объявления и метаданные уже найдены (см. RegInserterImpl::make_info)
+  bool resolved = false;
+  MetadataAsValue* MD = nullptr;
+  Function* ReadRegister = nullptr;
+  Function* WriteRegister = nullptr;
+  GlobalVariable* Chain = nullptr;
+
+  // данные модуля M; прежний модуль, если он был, забывается
+  RegInserterModuleInfo& get(Module& module)
+  {
+    if (M != &module) {
+      *this = RegInserterModuleInfo();
+      M = &module;
+      reg = reserved_register(module);
+    }
+    return *this;
+  }
+};
 
 namespace {
-struct RegInserter : public FunctionPass {
-  static char ID;
-  RegInserter() : FunctionPass(ID) {}
+// Обход дерева доминаторов по вызовам и уже вставленным последовательностям
+// (метаданные reg_inserter.callee): последовательность объявляет функции из
+// своих метаданных, вызов - свою функцию, если она еще не объявлена. Нужен
+// поздней чистке и повторному запуску прохода над уже обработанным кодом.
+struct SequenceWalker {
+  ScopedAvailability declared;
+  // последовательность или вызов, объявившие функцию; актуально, пока она объявлена
+  std::vector<Instruction*> declared_by;
+
+  // on_call(call, by): by - последовательность или вызов, раньше объявившие
+  // функцию вызова, nullptr - вызов объявляет ее сам;
+  // on_sequence(write, indirect, has_calls): indirect - последовательность
+  // обслуживает косвенный вызов, has_calls - у ее функций остались вызовы
+  template <typename OnCall, typename OnSequence>
+  void walk(DominatorTree& DT, const CallSiteTable& call_sites, unsigned tag_kind,
+            OnCall on_call, OnSequence on_sequence)
+  {
+    declared.reset(call_sites.num_callees());
+    declared_by.assign(call_sites.num_callees(), nullptr);
+    for (DomTreeNode* node : depth_first(DT.getRootNode())) {
+      declared.pop_to(node->getLevel());
+      declared.push_scope(node->getLevel());
+      BasicBlock& BB = *node->getBlock();
+      ArrayRef<CallSiteTable::CallSite> calls = call_sites.calls(&BB);
+      // косвенные вызовы в метаданных не названы: последовательность
+      // обслуживает столько первых необъявленных косвенных вызовов после
+      // себя, сколько у нее операндов "indirect", пока между вызовами нет
+      // записи в память (так их объединяет -reg-inserter-coalesce)
+      Instruction* indirect_by = nullptr;
+      unsigned n_indirect = 0;
+      for (Instruction& I : BB) {
+        if (!calls.empty() && calls.front().call == &I) {
+          CallSiteTable::CalleeId callee = calls.front().callee;
+          calls = calls.drop_front();
+          bool first = declared.declare(callee);
+          if (first && n_indirect && !isa<Constant>(call_sites.callee(callee))) {
+            n_indirect--;
+            declared_by[callee] = indirect_by;
+            on_call(I, indirect_by);
+            continue;
+          }
+          if (first)
+            declared_by[callee] = &I;
+          on_call(I, first ? nullptr : declared_by[callee]);
+          continue;
+        }
+        MDNode* tag = I.hasMetadataOtherThanDebugLoc() ? I.getMetadata(tag_kind) : nullptr;
+        if (!tag) {
+          if (I.mayWriteToMemory())
+            n_indirect = 0;
+          continue;
+        }
+        bool indirect = false;
+        bool has_calls = false;
+        n_indirect = 0;
+        for (const MDOperand& op : tag->operands()) {
+          // пустой операнд - функция удалена (например, встроена во все места вызова)
+          auto value = dyn_cast_or_null<ValueAsMetadata>(op);
+          if (op && !value) {
+            indirect = true;
+            n_indirect++;
+            continue;
+          }
+          CallSiteTable::CalleeId callee;
+          if (!value || !call_sites.find(value->getValue(), callee))
+            continue;
+          has_calls = true;
+          if (declared.declare(callee))
+            declared_by[callee] = &I;
+        }
+        indirect_by = &I;
+        on_sequence(I, indirect, has_calls);
+      }
+    }
+  }
+};
 
+// общая реализация прохода, используется обоими менеджерами проходов
+struct RegInserterImpl {
   struct Info
   {
     Module* M;
@@ -35,187 +364,1355 @@ struct RegInserter : public FunctionPass {
     IntegerType* int64_ty;
     PointerType* void_ptr;
     MetadataAsValue* MD;
+    // объявления интринсиков ищутся один раз, а не перед каждым вызовом
+    Function* ReadRegister;
+    Function* WriteRegister;
+    // глобальная переменная цепочки; nullptr - цепочка в регистре
+    GlobalVariable* Chain;
   };
 
-  void insert_addition_code(Instruction& I, Info& additionData)
+  // объявления и метаданные берутся из module_info, при первой функции
+  // модуля они там создаются; регистр используется только с
+  // -reg-inserter-lowering=register
+  Info make_info(Module& M)
+  {
+    auto& C = M.getContext();
+    Info info{
+      &M,
+      C,
+      Type::getInt64Ty(C),
+      PointerType::getInt8PtrTy(C, 0),
+      nullptr,
+      nullptr,
+      nullptr,
+      nullptr
+    };
+    RegInserterModuleInfo& shared = *module_info;
+    if (!shared.resolved) {
+      shared.resolved = true;
+      if (RegInserterLowering == REGISTER_LOWERING) {
+        shared.MD = MetadataAsValue::get(C, MDNode::get(C, {MDString::get(C, shared.reg)}));
+        shared.WriteRegister = Intrinsic::getDeclaration(&M, Intrinsic::write_register, info.int64_ty);
+        shared.ReadRegister = Intrinsic::getDeclaration(&M, Intrinsic::read_register, info.int64_ty);
+      } else {
+        // одна переменная на программу: linkonce_odr объединяется при линковке
+        // единиц трансляции, hidden и initial-exec дают прямой доступ в исполняемом файле
+        shared.Chain = M.getGlobalVariable(reg_inserter_chain);
+        if (!shared.Chain) {
+          shared.Chain = new GlobalVariable(M, info.int64_ty, false, GlobalValue::LinkOnceODRLinkage,
+                                            ConstantInt::get(info.int64_ty, 0), reg_inserter_chain);
+          shared.Chain->setVisibility(GlobalValue::HiddenVisibility);
+          if (RegInserterLowering == THREAD_LOCAL_LOWERING)
+            shared.Chain->setThreadLocalMode(GlobalValue::InitialExecTLSModel);
+        }
+      }
+    }
+    info.MD = shared.MD;
+    info.ReadRegister = shared.ReadRegister;
+    info.WriteRegister = shared.WriteRegister;
+    info.Chain = shared.Chain;
+    return info;
+  }
+
+  // чтение и запись указателя цепочки там, где его хранит -reg-inserter-lowering
+  static Instruction* read_chain(Info& additionData, Instruction* before)
+  {
+    if (!additionData.Chain)
+      return CallInst::Create(additionData.ReadRegister->getFunctionType(), additionData.ReadRegister, {additionData.MD}, "", before);
+    return new LoadInst(additionData.int64_ty, additionData.Chain, "", before);
+  }
+
+  static Instruction* write_chain(Info& additionData, Value* value, Instruction* before)
   {
-    Function *ReadRegister = Intrinsic::getDeclaration(additionData.M, Intrinsic::read_register, additionData.int64_ty);
-    auto call = CallInst::Create(ReadRegister->getFunctionType(), ReadRegister, {additionData.MD}, "", &I);
+    if (!additionData.Chain)
+      return CallInst::Create(additionData.WriteRegister->getFunctionType(), additionData.WriteRegister, {additionData.MD, value}, "", before);
+    return new StoreInst(value, additionData.Chain, before);
+  }
+
+  // дописывает функцию в метаданные reg_inserter.callee записи цепочки;
+  // на значение указателя из тела функции сослаться в метаданных нельзя,
+  // поэтому косвенный вызов обозначается строкой "indirect" (пустым
+  // операнд становится после удаления функции из модуля)
+  void tag_callee(Instruction* write, CallSiteTable::CalleeId callee, Info& additionData)
+  {
+    SmallVector<Metadata*, 4> callees;
+    if (MDNode* tag = write->getMetadata(reg_inserter_callee_md))
+      callees.append(tag->op_begin(), tag->op_end());
+    Value* F = call_sites.callee(callee);
+    callees.push_back(isa<Constant>(F) ? static_cast<Metadata*>(ValueAsMetadata::get(F))
+                                       : MDString::get(additionData.C, "indirect"));
+    write->setMetadata(reg_inserter_callee_md, MDNode::get(additionData.C, callees));
+  }
+
+  // возвращает вставленную запись цепочки (llvm.write_register или store);
+  // callee - функция, для вызовов которой вставлена последовательность
+  Instruction* insert_sequence(Instruction& I, CallSiteTable::CalleeId callee, Info& additionData)
+  {
+    auto call = read_chain(additionData, &I);
     auto int_cast = new IntToPtrInst(call, PointerType::get(additionData.void_ptr, 0), "", &I);
     auto load = new LoadInst(additionData.void_ptr, int_cast, "", &I);
     auto ptr_cast = new PtrToIntInst(load, additionData.int64_ty , "", &I);
-    Function *WriteRegister = Intrinsic::getDeclaration(additionData.M, Intrinsic::write_register, additionData.int64_ty);
-    CallInst::Create(WriteRegister->getFunctionType(), WriteRegister, {additionData.MD, ptr_cast}, "", &I);
+    Instruction* write = write_chain(additionData, ptr_cast, &I);
+    tag_callee(write, callee, additionData);
+    return write;
   }
 
-  #if ALGORITHM == DFS_IMP
+  // последовательность прямо перед вызовом I
+  Instruction* insert_addition_code(Instruction& I, CallSiteTable::CalleeId callee, Info& additionData)
+  {
+    if (recording)
+      recording->sites.push_back({hasher.index(&I), callee, ResultCache::at_call});
+    Instruction* write = insert_sequence(I, callee, additionData);
+    if (RegInserterCounters)
+      counted.push_back({write, &I, callee});
+    return write;
+  }
 
-  std::set<size_t> declarated_functions;
+  // последовательность, стоящая не прямо перед вызовом (в предзаголовке
+  // цикла или в доминирующем блоке); в профиле ее место - терминатор блока,
+  // а терминатор-invoke уже занят местом своего вызова
+  Instruction* insert_detached_code(Instruction& I, CallSiteTable::CalleeId callee, Info& additionData)
+  {
+    if (recording)
+      recording->sites.push_back({hasher.index(&I), callee, ResultCache::detached});
+    Instruction* write = insert_sequence(I, callee, additionData);
+    if (RegInserterCounters && !isa<CallBase>(I))
+      counted.push_back({write, &I, callee});
+    return write;
+  }
 
-  bool DFS_based_imp(DomTreeNode* node, Info& additionData){
-    bool changed = false;
-    std::stack<size_t> saved_functions;
-    BasicBlock& BB = *node->getBlock();
-    for (Instruction& I : BB) {
-      if(I.getOpcode() != Instruction::Call) {
-        continue;
-      }
-      auto CI = cast<CallInst>(&I);
-      if (CI->getCalledFunction()->isIntrinsic()) {
-        continue;
+  // вызов call функции callee обходится последовательностью write
+  // (-reg-inserter-coalesce), функция дописывается в ее метаданные
+  void share_code(Instruction* write, Instruction& call, CallSiteTable::CalleeId callee, Info& additionData)
+  {
+    if (recording)
+      recording->sites.push_back({hasher.index(&call), callee, ResultCache::shared});
+    tag_callee(write, callee, additionData);
+  }
+
+  // замечания для -pass-remarks*: Missed - место, где пришлось вставить
+  // последовательность, Passed - вызов, обошедшийся без своей последовательности
+  OptimizationRemarkEmitter* ORE = nullptr;
+
+  void remark_inserted(CallBase* call, CallSiteTable::CalleeId callee)
+  {
+    ORE->emit([&]() {
+      return OptimizationRemarkMissed(DEBUG_TYPE, "Inserted", call)
+             << "register sequence inserted before call to "
+             << ore::NV("Callee", call_sites.callee(callee))
+             << ": no dominating call to it";
+    });
+  }
+
+  // by - вызов или вынесенная последовательность, доминирующие над call
+  void remark_elided(CallBase* call, CallSiteTable::CalleeId callee, Instruction* by, StringRef reason)
+  {
+    ORE->emit([&]() {
+      return OptimizationRemark(DEBUG_TYPE, "Elided", call)
+             << "call to " << ore::NV("Callee", call_sites.callee(callee))
+             << " needs no register sequence: " << ore::NV("Reason", reason) << " "
+             << ore::NV("DominatingSite", by) << " in "
+             << ore::NV("DominatingBlock", by->getParent()->getName());
+    });
+  }
+
+  void remark_placed(Instruction* write, CallSiteTable::CalleeId callee, StringRef reason)
+  {
+    ORE->emit([&]() {
+      return OptimizationRemark(DEBUG_TYPE, "Placed", write)
+             << "register sequence for calls to "
+             << ore::NV("Callee", call_sites.callee(callee)) << " placed in "
+             << ore::NV("Block", write->getParent()->getName()) << ": " << ore::NV("Reason", reason);
+    });
+  }
+
+  // функции, которые не обращаются к x28 даже транзитивно; вызовы
+  // к ним пропускаются (задается только межпроцедурным режимом)
+  const DenseSet<const Function*>* clean_functions = nullptr;
+
+  // данные модуля, общие для его функций; задается проходом, который
+  // хранит их между функциями
+  RegInserterModuleInfo* module_info = nullptr;
+
+  // таблица мест вызова и множество уже объявленных функций,
+  // общие для обеих реализаций обхода
+  CallSiteTable call_sites;
+  ScopedAvailability declarated_functions;
+  // то же множество для -reg-inserter-algorithm=interval
+  DominanceIntervals intervals;
+  // инструкция, после которой функция считается объявленной (для замечаний);
+  // значение актуально, пока функция объявлена
+  std::vector<Instruction*> declared_by;
+
+  // функции, последовательности которых вынесены в конец блока-предзаголовка
+  DenseMap<const BasicBlock*, SmallVector<CallSiteTable::CalleeId, 4>> hoisted;
+
+  // кэш результатов (-reg-inserter-cache-dir): хэш нумерует инструкции
+  // функции, при промахе места вставки записываются в recording
+  FunctionHasher hasher;
+  ResultCache::Entry* recording = nullptr;
+
+  // места -reg-inserter-counters: запись цепочки, вызов перед ней (у вынесенной
+  // последовательности - терминатор ее блока) и функция вызова
+  struct CountedSite
+  {
+    Instruction* write;
+    Instruction* call;
+    CallSiteTable::CalleeId callee;
+  };
+  std::vector<CountedSite> counted;
+
+  // места функции в профиле -reg-inserter-profile; nullptr - профиля нет
+  // или функции в нем нет (изменилась после профилирования)
+  const SiteProfile::Function* profiled = nullptr;
+
+  // последовательность перед вызовом в профилирующей сборке ни разу не
+  // исполнилась; вызовы, перед которыми ее не было, считаются неизвестными
+  bool is_cold(const Instruction* call) const
+  {
+    if (!profiled)
+      return false;
+    auto it = profiled->sites.find(hasher.index(call));
+    return it != profiled->sites.end() && !it->second.count;
+  }
+
+  // счетчики для -reg-inserter-report
+  unsigned n_inserted = 0;
+  unsigned n_merged = 0;
+  unsigned n_hoisted = 0;
+  unsigned n_elided = 0;
+  unsigned n_cold = 0;
+
+  // вызов выполняется на каждой итерации цикла, если его блок доминирует
+  // над всеми переходами на следующую итерацию
+  static bool runs_every_iteration(const BasicBlock* BB, const Loop* L, DominatorTree& DT)
+  {
+    SmallVector<BasicBlock*, 4> latches;
+    L->getLoopLatches(latches);
+    for (BasicBlock* latch : latches)
+      if (!DT.dominates(BB, latch))
+        return false;
+    return true;
+  }
+
+  // для каждого вызова внутри цикла ищем самый внешний предзаголовок,
+  // в который можно поднять последовательность
+  void find_hoisted(Function& F, DominatorTree& DT, LoopInfo& LI)
+  {
+    hoisted.clear();
+    for (BasicBlock& BB : F) {
+      for (const CallSiteTable::CallSite& site : call_sites.calls(&BB)) {
+        BasicBlock* target = nullptr;
+        BasicBlock* from = &BB;
+        for (Loop* L = LI.getLoopFor(from); L; L = LI.getLoopFor(from)) {
+          BasicBlock* preheader = L->getLoopPreheader();
+          if (!preheader || !runs_every_iteration(from, L, DT))
+            break;
+          target = from = preheader;
+        }
+        // на значение указателя из тела функции нельзя сослаться в метаданных,
+        // поэтому косвенные вызовы не выносятся
+        if (!target || !isa<Constant>(call_sites.callee(site.callee)))
+          continue;
+        // вызов, не исполнявшийся по профилю, не тянет последовательность
+        // в предзаголовок: тот может исполняться и без него
+        if (is_cold(site.call)) {
+          n_cold++;
+          continue;
+        }
+        hoisted[target].push_back(site.callee);
       }
-      size_t func_id = reinterpret_cast<size_t>(CI->getCalledFunction());
+    }
+  }
+
+  bool needs_visit(const BasicBlock* BB) const
+  {
+    return call_sites.has_calls(BB) || hoisted.count(BB);
+  }
+
+  // есть ли между двумя вызовами инструкция, которая может изменить цепочку x28
+  static bool writes_between(Instruction* from, Instruction* to)
+  {
+    for (Instruction* I = from->getNextNode(); I != to; I = I->getNextNode())
+      if (I->mayWriteToMemory())
+        return true;
+    return false;
+  }
+
+  // обрабатывает вызовы одного блока, блоки без вызовов сюда не попадают;
+  // область видимости блока в declared (ScopedAvailability или
+  // DominanceIntervals) уже открыта
+  template <typename Availability>
+  bool process_block(BasicBlock& BB, Availability& declared, Info& additionData)
+  {
+    bool changed = false;
+    // открыта ли последовательность, которую могут разделить следующие вызовы
+    bool group_open = false;
+    Instruction* prev_call = nullptr;
+    Instruction* group_start = nullptr;
+    Instruction* group_write = nullptr;
+    for (const CallSiteTable::CallSite& site : call_sites.calls(&BB)) {
+      if (group_open)
+        group_open = !writes_between(prev_call, site.call);
+      prev_call = site.call;
       //если ранее не была использована такая функция, то вставляем код для работы с регистром
-      if(!declarated_functions.count(func_id)){
-        insert_addition_code(I,additionData);
+      if(declared.declare(site.callee)){
+        declared_by[site.callee] = site.call;
+        if (group_open) {
+          // уже вставленная в этом блоке последовательность доминирует над вызовом
+          n_merged++;
+          share_code(group_write, *site.call, site.callee, additionData);
+          remark_elided(site.call, site.callee, group_start, "shares the sequence of");
+          continue;
+        }
+        group_write = insert_addition_code(*site.call, site.callee, additionData);
+        remark_inserted(site.call, site.callee);
+        n_inserted++;
         changed = true;
-        // добавляем в набор функций, перед которыми уже было обращение к регистру
-        declarated_functions.insert(func_id);
-        saved_functions.push(func_id);
+        group_open = RegInserterCoalesce;
+        group_start = site.call;
+      } else {
+        n_elided++;
+        remark_elided(site.call, site.callee, declared_by[site.callee], "dominated by");
       }
     }
-    for(auto& child : node->children())
-      changed |= DFS_based_imp(child, additionData);
-    while(!saved_functions.empty())
-    {
-      declarated_functions.erase(saved_functions.top());
-      saved_functions.pop();
+    // вынесенные из циклов последовательности ставим перед переходом в цикл
+    auto it = hoisted.find(&BB);
+    if (it == hoisted.end())
+      return changed;
+    for (CallSiteTable::CalleeId callee : it->second) {
+      if(declared.declare(callee)){
+        Instruction* write = insert_detached_code(*BB.getTerminator(), callee, additionData);
+        declared_by[callee] = write;
+        remark_placed(write, callee, "hoisted into the loop preheader");
+        n_inserted++;
+        n_hoisted++;
+        changed = true;
+      }
     }
     return changed;
   }
 
-  #endif
-
-  #if ALGORITHM == STACK_IMP
-
+  bool DFS_based_imp(DomTreeNode* node, Info& additionData){
+    bool changed = false;
+    BasicBlock& BB = *node->getBlock();
+    if(needs_visit(&BB)) {
+      declarated_functions.push_scope(node->getLevel());
+      changed |= process_block(BB, declarated_functions, additionData);
+    }
+    for(auto& child : node->children())
+      changed |= DFS_based_imp(child, additionData);
+    // убираем функции, объявленные в поддереве данной вершины
+    declarated_functions.pop_to(node->getLevel());
+    return changed;
+  }
 
   bool stack_based_imp(DominatorTree* dTree, Info& additionData)
   {
     bool changed = false;
-    // множество, хранящее набор функций, которые уже опеределены в данной конкретной вершине
-    std::set<size_t> declarated_functions;
-    // стековая организация локальных переменных из алгоритма DFS
-    struct LocalData
-    {
-      std::stack<size_t> saved_functions;
-      size_t current_child;
-    };
-    std::stack<LocalData> local_variables;
-    local_variables.push({});
     //проходимся по дереву доминаторов в порядке DFS
     for(auto node  = GraphTraits<DominatorTree*>::nodes_begin(dTree);
              node != GraphTraits<DominatorTree*>::nodes_end(dTree);
-             node ++
+             ++node
     )
     {
+      // закрываем области видимости всех вершин, не являющихся предками текущей
+      declarated_functions.pop_to(node->getLevel());
       BasicBlock& BB = *node->getBlock();
-      for (Instruction& I : BB) {
-        if(I.getOpcode() != Instruction::Call) {
-          continue;
+      if(needs_visit(&BB)) {
+        declarated_functions.push_scope(node->getLevel());
+        changed |= process_block(BB, declarated_functions, additionData);
+      }
+    }
+    return changed;
+  }
+
+  // блок с вызовами и номера DFS-обхода дерева доминаторов: in - номер блока
+  // в прямом порядке, out - наибольший номер в его поддереве
+  struct NumberedBlock
+  {
+    BasicBlock* BB;
+    ArrayRef<CallSiteTable::CallSite> calls;
+    unsigned in;
+    unsigned out;
+  };
+
+  // обход без областей видимости: для каждой функции собираются интервалы
+  // [in, out] объявляющих ее блоков, затем блоки с вызовами обрабатываются
+  // в прямом порядке, а покрытие вызова проверяется бинарным поиском по
+  // интервалам его функции
+  bool interval_based_imp(DominatorTree& DT, Info& additionData)
+  {
+    // один итеративный обход дерева нумерует узлы и выписывает блоки с вызовами
+    std::vector<NumberedBlock> order;
+    struct Frame
+    {
+      DomTreeNode* node;
+      DomTreeNode::iterator next_child;
+      unsigned index; // индекс блока в order или UINT_MAX
+    };
+    SmallVector<Frame, 32> stack;
+    unsigned clock = 0;
+    auto enter = [&](DomTreeNode* N) {
+      BasicBlock* BB = N->getBlock();
+      unsigned index = UINT_MAX;
+      ArrayRef<CallSiteTable::CallSite> calls = call_sites.calls(BB);
+      if (!calls.empty() || (!hoisted.empty() && hoisted.count(BB))) {
+        index = order.size();
+        order.push_back({BB, calls, clock, clock});
+      }
+      clock++;
+      stack.push_back({N, N->begin(), index});
+    };
+    enter(DT.getRootNode());
+    while (!stack.empty()) {
+      Frame& frame = stack.back();
+      if (frame.next_child != frame.node->end()) {
+        enter(*frame.next_child++);
+        continue;
+      }
+      if (frame.index != UINT_MAX)
+        order[frame.index].out = clock - 1;
+      stack.pop_back();
+    }
+
+    intervals.reset(call_sites.num_callees());
+    for (const NumberedBlock& block : order) {
+      for (const CallSiteTable::CallSite& site : block.calls)
+        intervals.add(site.callee, block.in, block.out);
+      auto it = hoisted.find(block.BB);
+      if (it != hoisted.end())
+        for (CallSiteTable::CalleeId callee : it->second)
+          intervals.add(callee, block.in, block.out);
+    }
+
+    // блок обрабатывается после своих доминаторов, поэтому declared_by
+    // функции, покрытой доминатором, указывает на его объявление
+    bool changed = false;
+    for (const NumberedBlock& block : order) {
+      intervals.enter_block(block.in, block.out);
+      changed |= process_block(*block.BB, intervals, additionData);
+    }
+    return changed;
+  }
+
+  // стоимость блока: число исполнений по профилю, если он есть, иначе оценка частоты
+  static uint64_t block_cost(const BasicBlock* BB, BlockFrequencyInfo& BFI)
+  {
+    if (auto count = BFI.getBlockProfileCount(BB))
+      return *count;
+    return BFI.getBlockFreq(BB).getFrequency();
+  }
+
+  // суммарная оценка числа исполнений последовательностей до и после
+  uint64_t cost_before = 0;
+  uint64_t cost_after = 0;
+
+  // выбор для одной функции набора блоков с минимальной суммарной частотой,
+  // доминирующего над всеми ее вызовами; blocks - блоки с вызовами
+  bool place_callee(CallSiteTable::CalleeId callee, ArrayRef<BasicBlock*> blocks,
+                    DominatorTree& DT, BlockFrequencyInfo& BFI, Info& additionData)
+  {
+    struct NodeState
+    {
+      uint64_t children_cost = 0; // лучшая стоимость покрытия поддеревьев детей
+      bool has_call = false;      // в блоке есть вызов функции
+      bool take = false;          // выгоднее поставить последовательность здесь, чем в поддеревьях
+      bool covered = false;       // последовательность стоит в этом узле или выше
+      bool call_above = false;    // вызов есть в этом узле или выше
+      bool hot = false;           // в поддереве есть вызов, не помеченный профилем как неисполнявшийся
+      Instruction* cover = nullptr; // последовательность или вызов, покрывающие узел
+    };
+    DenseMap<DomTreeNode*, NodeState> state;
+    // последовательность косвенного вызова остается перед самим вызовом,
+    // см. find_hoisted
+    bool can_detach = isa<Constant>(call_sites.callee(callee));
+    // узлы, в поддереве которых есть вызовы, вместе с их предками
+    SmallVector<DomTreeNode*, 16> relevant;
+    for (BasicBlock* BB : blocks) {
+      DomTreeNode* start = DT.getNode(BB);
+      for (DomTreeNode* N = start; N; N = N->getIDom()) {
+        if (state.try_emplace(N).second)
+          relevant.push_back(N);
+        else if (N != start)
+          break;
+      }
+      NodeState& S = state[start];
+      S.has_call = true;
+      if (!profiled)
+        S.hot = true;
+      for (const CallSiteTable::CallSite& site : call_sites.calls(BB))
+        S.hot |= site.callee == callee && !is_cold(site.call);
+    }
+    // снизу вверх: стоимость покрытия поддерева
+    llvm::sort(relevant, [](DomTreeNode* a, DomTreeNode* b) { return a->getLevel() > b->getLevel(); });
+    for (DomTreeNode* N : relevant) {
+      NodeState& S = state[N];
+      uint64_t own = block_cost(N->getBlock(), BFI);
+      bool cheaper = !S.has_call && can_detach && own <= S.children_cost;
+      // последовательности неисполнявшихся по профилю вызовов остаются на месте
+      if (cheaper && !S.hot)
+        n_cold++;
+      S.take = S.has_call || (cheaper && S.hot);
+      if (DomTreeNode* parent = N->getIDom()) {
+        state[parent].children_cost += S.take ? own : S.children_cost;
+        state[parent].hot |= S.hot;
+      }
+    }
+    // сверху вниз: последовательность ставится в самом верхнем выгодном узле
+    bool changed = false;
+    for (DomTreeNode* N : reverse(relevant)) {
+      NodeState& S = state[N];
+      NodeState* P = N->getIDom() ? &state[N->getIDom()] : nullptr;
+      bool parent_covered = P && P->covered;
+      bool parent_call_above = P && P->call_above;
+      S.covered = parent_covered || S.take;
+      S.call_above = parent_call_above || S.has_call;
+      S.cover = P ? P->cover : nullptr;
+      uint64_t own = block_cost(N->getBlock(), BFI);
+      if (S.has_call && !parent_call_above)
+        cost_before += own;
+      BasicBlock& BB = *N->getBlock();
+      if (S.take && !parent_covered) {
+        cost_after += own;
+        if (!S.has_call) {
+          Instruction* write = insert_detached_code(*BB.getTerminator(), callee, additionData);
+          remark_placed(write, callee, "lowest estimated frequency among dominating blocks");
+          S.cover = write;
+          n_hoisted++;
+          n_inserted++;
+          changed = true;
         }
-        auto CI = cast<CallInst>(&I);
-        if (CI->getCalledFunction()->isIntrinsic()) {
+      }
+      if (!S.has_call)
+        continue;
+      // первый вызов непокрытого блока получает последовательность,
+      // остальные вызовы функции в блоке покрыты им
+      for (const CallSiteTable::CallSite& site : call_sites.calls(&BB)) {
+        if (site.callee != callee)
+          continue;
+        if (S.cover) {
+          n_elided++;
+          remark_elided(site.call, callee, S.cover, "dominated by");
           continue;
         }
-        // эту переменную будем использовать как
-        // уникальный индентификатор для каждой функции
-        size_t func_id = reinterpret_cast<size_t>(CI->getCalledFunction());
-        //если ранее не была использована такая функция, то вcтавялем код для работы с регистром
-        if(!declarated_functions.count(func_id)){
-          insert_addition_code(I, additionData);
-          changed = true;
-          // добавляем в набор функций, перед которыми уже было обращение к регистру
-          declarated_functions.insert(func_id);
-          // сохраняем порядок вставки в set
-          local_variables.top().saved_functions.push(func_id);
-        }
+        insert_addition_code(*site.call, callee, additionData);
+        remark_inserted(site.call, callee);
+        S.cover = site.call;
+        n_inserted++;
+        changed = true;
       }
+    }
+    return changed;
+  }
+
+  bool frequency_based_imp(Function& F, DominatorTree& DT, BlockFrequencyInfo& BFI, Info& additionData)
+  {
+    // для каждой функции - достижимые блоки, в которых она вызывается
+    std::vector<SmallVector<BasicBlock*, 4>> blocks_of(call_sites.num_callees());
+    for (BasicBlock& BB : F) {
+      if (!DT.getNode(&BB))
+        continue;
+      for (const CallSiteTable::CallSite& site : call_sites.calls(&BB))
+        if (blocks_of[site.callee].empty() || blocks_of[site.callee].back() != &BB)
+          blocks_of[site.callee].push_back(&BB);
+    }
+    bool changed = false;
+    for (CallSiteTable::CalleeId callee = 0; callee < blocks_of.size(); callee++)
+      if (!blocks_of[callee].empty())
+        changed |= place_callee(callee, blocks_of[callee], DT, BFI, additionData);
+    return changed;
+  }
+
+  // Initialize x28 reg: слот цепочки y на стеке точки входа (main или потока)
+  // живет, пока поток выполняет функцию. Прежнее значение цепочки (в новом
+  // потоке - мусор) восстанавливается перед каждым выходом: x28 callee-saved
+  // для вызывающего кода (например, start_thread из libc), а после выхода
+  // из функции слот y уже недействителен
+  void init_chain(Function& F, Info& info)
+  {
+    auto &EBB = F.getEntryBlock();
+    auto &I = *EBB.getFirstInsertionPt();
+    Instruction* saved = read_chain(info, &I);
+    // void *y;
+    auto alloca = new AllocaInst(info.void_ptr, 0, "", &I);
+    // x28 = &y;
+    auto ptr_cast = new PtrToIntInst(alloca, info.int64_ty , "", &I);
+    write_chain(info, ptr_cast, &I)->setMetadata(reg_inserter_init_md, MDNode::get(info.C, {}));
+    // y = x;
+    auto call = read_chain(info, &I);
+    auto int_cast = new IntToPtrInst(call, info.void_ptr, "", &I);
+    new StoreInst(int_cast, alloca, &I);
+
+    for (BasicBlock& BB : F) {
+      Instruction* exit = BB.getTerminator();
+      if (!isa<ReturnInst>(exit) && !isa<ResumeInst>(exit))
+        continue;
+      // между musttail вызовом и ret ничего вставлять нельзя
+      if (CallInst* tail = BB.getTerminatingMustTailCall())
+        exit = tail;
+      write_chain(info, saved, exit);
+    }
+  }
+
+  // пролог init_chain, вставленный предыдущим запуском
+  static bool has_chain_init(Function& F)
+  {
+    unsigned init_kind = F.getContext().getMDKindID(reg_inserter_init_md);
+    for (Instruction& I : F.getEntryBlock())
+      if (I.hasMetadataOtherThanDebugLoc() && I.getMetadata(init_kind))
+        return true;
+    return false;
+  }
+
+  // вызовы, которые уже обслуживают последовательности предыдущего
+  // запуска: объявлены последовательностью или таким же вызовом
+  DenseSet<const Instruction*> find_covered(DominatorTree& DT, unsigned tag_kind)
+  {
+    DenseSet<const Instruction*> covered;
+    SequenceWalker walker;
+    walker.walk(DT, call_sites, tag_kind,
+      [&](Instruction& call, Instruction* by) {
+        if (by && (by->getMetadata(tag_kind) || covered.count(by)))
+          covered.insert(&call);
+      },
+      [](Instruction&, bool, bool) {});
+    return covered;
+  }
+
+  // первая инструкция последовательности (чтение цепочки) по ее записи
+  static Instruction* sequence_start(Instruction* write)
+  {
+    Value* value = isa<StoreInst>(write) ? cast<StoreInst>(write)->getValueOperand()
+                                         : cast<CallInst>(write)->getArgOperand(1);
+    auto load = cast<LoadInst>(cast<PtrToIntInst>(value)->getOperand(0));
+    return cast<Instruction>(cast<IntToPtrInst>(load->getPointerOperand())->getOperand(0));
+  }
 
+  // строка с именем функции для reg_inserter_rt.c, одна на модуль: имя
+  // глобала задается содержимым, поэтому одинаковые строки частей
+  // reg_inserter_driver и единиц трансляции объединяются при линковке, а
+  // результат не зависит от того, какая функция создала строку первой
+  static Constant* name_string(Module& M, StringRef name)
+  {
+    std::string global_name = ("__reg_inserter_name." + name).str();
+    GlobalVariable* global = M.getNamedGlobal(global_name);
+    if (!global) {
+      Constant* init = ConstantDataArray::getString(M.getContext(), name);
+      global = new GlobalVariable(M, init->getType(), true, GlobalValue::LinkOnceODRLinkage,
+                                  init, global_name);
+      global->setVisibility(GlobalValue::HiddenVisibility);
+      global->setUnnamedAddr(GlobalValue::UnnamedAddr::Global);
+      global->setAlignment(Align(1));
+    }
+    Constant* zero = ConstantInt::get(Type::getInt32Ty(M.getContext()), 0);
+    return ConstantExpr::getInBoundsGetElementPtr(global->getValueType(), global,
+                                                  ArrayRef<Constant*>{zero, zero});
+  }
 
-      // отдельно рассматриваем случай, когда в дереве возникает развилка
-      if(node->getNumChildren() > 1)
-      {
-        local_variables.top().current_child = node->getNumChildren();
-        local_variables.push({});
+  // -reg-inserter-counters: перед каждой последовательностью из counted
+  // увеличивается счетчик в массиве функции, а описание мест кладется в
+  // секцию reg_inserter_sites, откуда его при выходе читает reg_inserter_rt.c.
+  // Счетчик стоит до чтения цепочки: между записью цепочки и вызовом не
+  // должно быть записей в память, иначе повторный запуск не узнает
+  // последовательность косвенного вызова (см. SequenceWalker)
+  void emit_counters(Function& F, const FunctionHasher::Key& key, Info& info)
+  {
+    Module& M = *F.getParent();
+    Type* int32_ty = Type::getInt32Ty(info.C);
+    auto counters_ty = ArrayType::get(info.int64_ty, counted.size());
+    auto counters = new GlobalVariable(M, counters_ty, false, GlobalValue::PrivateLinkage,
+                                       ConstantAggregateZero::get(counters_ty),
+                                       "__reg_inserter_counters." + F.getName());
+    IRBuilder<> B(info.C);
+    SmallVector<Constant*, 8> calls;
+    SmallVector<Constant*, 8> callees;
+    DenseMap<CallSiteTable::CalleeId, Constant*> names;
+    for (unsigned i = 0; i < counted.size(); i++) {
+      const CountedSite& site = counted[i];
+      B.SetInsertPoint(sequence_start(site.write));
+      Value* slot = B.CreateConstInBoundsGEP2_32(counters_ty, counters, 0, i);
+      B.CreateStore(B.CreateAdd(B.CreateLoad(info.int64_ty, slot), B.getInt64(1)), slot);
+      calls.push_back(B.getInt32(hasher.index(site.call)));
+      Constant*& name = names[site.callee];
+      if (!name) {
+        Value* callee = call_sites.callee(site.callee);
+        name = name_string(M, isa<Constant>(callee) && callee->hasName() ? callee->getName()
+                                                                          : "indirect");
       }
+      callees.push_back(name);
+    }
+    // массив в приватной константе и указатель на его начало
+    auto array = [&](Type* element_ty, ArrayRef<Constant*> elements, const Twine& name) -> Constant* {
+      auto array_ty = ArrayType::get(element_ty, elements.size());
+      auto global = new GlobalVariable(M, array_ty, true, GlobalValue::PrivateLinkage,
+                                       ConstantArray::get(array_ty, elements), name);
+      return ConstantExpr::getInBoundsGetElementPtr(array_ty, global,
+                                                    ArrayRef<Constant*>{B.getInt32(0), B.getInt32(0)});
+    };
+    Constant* fields[] = {
+      ConstantDataArray::get(info.C, makeArrayRef(key.Bytes.data(), key.Bytes.size())),
+      name_string(M, F.getName()),
+      B.getInt64(counted.size()),
+      array(int32_ty, calls, "__reg_inserter_calls." + F.getName()),
+      array(info.void_ptr, callees, "__reg_inserter_callees." + F.getName()),
+      ConstantExpr::getInBoundsGetElementPtr(counters_ty, counters,
+                                             ArrayRef<Constant*>{B.getInt32(0), B.getInt32(0)})};
+    // записи всех функций лежат в секции подряд, поэтому размер записи
+    // (56 байт на 64-битной цели) кратен выравниванию; запись не константа,
+    // иначе указатели в ней дали бы перемещения в секции только для чтения
+    Constant* record_init = ConstantStruct::getAnon(info.C, fields);
+    auto record = new GlobalVariable(M, record_init->getType(), false, GlobalValue::PrivateLinkage,
+                                     record_init, "__reg_inserter_record." + F.getName());
+    record->setSection("reg_inserter_sites");
+    record->setAlignment(Align(8));
+    appendToCompilerUsed(M, {record});
+    NumCounted += counted.size();
+  }
 
-      //проверка на то, что мы находимся в листе дерева
-      if(!node->getNumChildren()){
-        do{
-          //убираем из множества те функции, которые были определены при проходе базового блока
-          std::stack<size_t>& saved_functions = local_variables.top().saved_functions;
-          while(!saved_functions.empty()){
-            declarated_functions.erase(saved_functions.top());
-            saved_functions.pop();
-          }
-          local_variables.pop();
-          if(!local_variables.empty() ? local_variables.top().current_child > 1 : 0)
-          {
-            local_variables.top().current_child--;
-            local_variables.push({});
-          }
-        }while(!local_variables.empty() ? local_variables.top().current_child == 1 : 0);
+  // места функции в профиле -reg-inserter-profile; профиль читается один раз на процесс
+  static const SiteProfile::Function* find_profile(Function& F, const FunctionHasher::Key& key)
+  {
+    std::string error;
+    bool first;
+    const SiteProfile* profile = SiteProfile::shared(RegInserterProfile, RegInserterProfileTop, error, first);
+    if (profile)
+      return profile->find(key);
+    if (first)
+      F.getContext().diagnose(DiagnosticInfoUnsupported(
+          F, "reg_inserter: cannot read profile '" + RegInserterProfile.getValue() + "': " + error +
+                 ", static placement is used", DiagnosticLocation(), DS_Warning));
+    return nullptr;
+  }
+
+  // все, от чего кроме самой функции зависит результат прохода
+  std::string cache_options(StringRef reg, bool entry) const
+  {
+    std::string options;
+    raw_string_ostream os(options);
+    os << "lowering " << RegInserterLowering << " register " << reg << " algorithm "
+       << RegInserterAlgorithm << " coalesce " << RegInserterCoalesce << " hoist "
+       << RegInserterHoistLoops << " frequency " << RegInserterFrequencyPlacement
+       << " ipo " << (clean_functions != nullptr) << " entry " << entry;
+    // из профиля размещение зависит только от неисполнявшихся мест
+    if (profiled) {
+      os << " cold";
+      for (const auto& site : profiled->sites)
+        if (!site.second.count)
+          os << ' ' << site.first;
+    }
+    return os.str();
+  }
+
+  // повторяет вставки, записанные в кэше; false - запись не подходит к функции
+  bool replay(const ResultCache::Entry& entry, Info& additionData)
+  {
+    for (size_t i = 0; i < entry.sites.size(); i++) {
+      const ResultCache::Site& site = entry.sites[i];
+      // разделить можно только последовательность перед вызовом
+      if (!hasher.instruction(site.at) || site.callee >= call_sites.num_callees() ||
+          (site.kind == ResultCache::shared && (i == 0 || entry.sites[i - 1].kind == ResultCache::detached)))
+        return false;
+    }
+    Instruction* write = nullptr;
+    for (const ResultCache::Site& site : entry.sites) {
+      Instruction& I = *hasher.instruction(site.at);
+      switch (site.kind) {
+      case ResultCache::at_call:
+        write = insert_addition_code(I, site.callee, additionData);
+        break;
+      case ResultCache::detached:
+        write = insert_detached_code(I, site.callee, additionData);
+        break;
+      case ResultCache::shared:
+        share_code(write, I, site.callee, additionData);
+        break;
       }
     }
-    return changed;
+    n_inserted = entry.n_inserted;
+    n_merged = entry.n_merged;
+    n_hoisted = entry.n_hoisted;
+    n_elided = entry.n_elided;
+    n_cold = entry.n_cold;
+    return true;
   }
 
-  #endif
+  // анализы запрашиваются лениво: при попадании в кэш они не нужны;
+  // LI используется только в режиме -reg-inserter-hoist-loops,
+  // BFI - только в режиме -reg-inserter-frequency-placement
+  struct Analyses
+  {
+    function_ref<DominatorTree&()> DT;
+    function_ref<LoopInfo&()> LI;
+    function_ref<BlockFrequencyInfo&()> BFI;
+  };
 
-  bool runOnFunction(Function &F) override {
+  bool run(Function &F, const Analyses& analyses) {
+    // функция уже обработана предыдущим запуском
+    if (F.hasFnAttribute(reg_inserter_instrumented)) {
+      NumSkippedInstrumented++;
+      return false;
+    }
     bool changed = false;
-    auto& C = F.getContext();
-    Info info{
-      F.getParent(),
-      F.getContext(),
-      Type::getInt64Ty(C),
-      PointerType::getInt8PtrTy(C, 0),
-      MetadataAsValue::get(C, MDNode::get(C, {MDString::get(C, "x28")}))
-    };
-    // Initialize x28 reg
-    if (F.getName() == "main") {
-      auto &EBB = F.getEntryBlock();
-      auto &I = *EBB.getFirstInsertionPt();
-      // void *y;
-      auto alloca = new AllocaInst(info.void_ptr, 0, "", &I);
-      // x28 = &y;
-      auto ptr_cast = new PtrToIntInst(alloca, info.int64_ty , "", &I);
-      Function *WriteRegister = Intrinsic::getDeclaration(info.M, Intrinsic::write_register, info.int64_ty);
-      CallInst::Create(WriteRegister->getFunctionType(), WriteRegister, {info.MD, ptr_cast}, "", &I);
-      // y = x;
-      Function *ReadRegister = Intrinsic::getDeclaration(info.M, Intrinsic::read_register, info.int64_ty);
-      auto call = CallInst::Create(ReadRegister->getFunctionType(), ReadRegister, {info.MD}, "", &I);
-      auto int_cast = new IntToPtrInst(call, info.void_ptr, "", &I);
-      new StoreInst(int_cast, alloca, &I);
+    // собираем вызовы и выдаем функциям плотные индексы
+    unsigned tag_kind = F.getContext().getMDKindID(reg_inserter_callee_md);
+    call_sites.scan(F, clean_functions, tag_kind);
+    // последовательности без отметки функции (атрибут потерян или код
+    // встроен из обработанной функции) объявляют свои функции, как при обходе
+    bool instrumented = !call_sites.tagged().empty();
+    if (instrumented) {
+      DenseSet<const Instruction*> covered = find_covered(analyses.DT(), tag_kind);
+      call_sites.scan(F, clean_functions, 0, &covered);
+    }
+    NumFunctions++;
+    NumCalls += call_sites.num_calls() + call_sites.num_skipped() + call_sites.num_covered();
+    NumElidedClean += call_sites.num_skipped();
+    NumCovered += call_sites.num_covered();
+    // main и точки входа потоков заводят собственную цепочку, если ее
+    // не завел предыдущий запуск
+    bool thread_entry = is_thread_entry(F);
+    bool entry = F.getName() == "main" || thread_entry;
+    if (entry && has_chain_init(F)) {
+      entry = false;
+      instrumented = true;
+    }
+    if (!entry && !call_sites.num_callees()) {
+      if (instrumented)
+        F.addFnAttr(reg_inserter_instrumented);
+      return instrumented;
+    }
+    module_info->get(*F.getParent());
+    StringRef reg;
+    if (RegInserterLowering == REGISTER_LOWERING)
+      reg = module_info->reg;
+    if (RegInserterLowering == REGISTER_LOWERING && reg.empty()) {
+      F.getContext().emitError("reg_inserter: no register can be reserved on target '" +
+                               F.getParent()->getTargetTriple() +
+                               "', set -reg-inserter-register or -reg-inserter-lowering");
+      return false;
+    }
+    Info info = make_info(*F.getParent());
+    // ключи считаются до вставки инициализации цепочки; ключ профиля не
+    // зависит от опций, чтобы профиль годился и для сборки с другим размещением
+    FunctionHasher::Key profile_key;
+    if (RegInserterCounters || !RegInserterProfile.empty()) {
+      profile_key = hasher.hash(F, "", nullptr);
+      if (!RegInserterProfile.empty())
+        profiled = find_profile(F, profile_key);
+    }
+    FunctionHasher::Key key;
+    ResultCache::Entry cached;
+    bool hit = false;
+    if (!RegInserterCacheDir.empty()) {
+      key = hasher.hash(F, cache_options(reg, entry), clean_functions);
+      hit = ResultCache(RegInserterCacheDir).lookup(key, cached);
+    }
+    // BFI для оценки "горячести" считается, только если она запрошена
+    OptimizationRemarkEmitter remarks(&F);
+    ORE = &remarks;
+    declared_by.assign(call_sites.num_callees(), nullptr);
+    if (entry) {
+      init_chain(F, info);
       changed = true;
     }
+    if (entry && thread_entry && RegInserterLowering == GLOBAL_LOWERING)
+      F.getContext().diagnose(DiagnosticInfoUnsupported(
+          F, "reg_inserter: thread entry with -reg-inserter-lowering=global, all threads "
+             "share one chain pointer", DiagnosticLocation(), DS_Warning));
 
-    DominatorTree* dTree = new DominatorTree(F);
+    if (hit && replay(cached, info)) {
+      NumCacheHits++;
+      ResultCache::hits()++;
+      changed |= !cached.sites.empty();
+    } else {
+      if (!RegInserterCacheDir.empty()) {
+        NumCacheMisses++;
+        ResultCache::misses()++;
+        cached = ResultCache::Entry();
+        recording = &cached;
+      }
+      TimeTraceScope scope("RegInserterTraversal", F.getName());
+      DominatorTree& DT = analyses.DT();
+      LoopInfo* LI = RegInserterHoistLoops ? &analyses.LI() : nullptr;
+      BlockFrequencyInfo* BFI = RegInserterFrequencyPlacement ? &analyses.BFI() : nullptr;
+      if (BFI) {
+        changed |= frequency_based_imp(F, DT, *BFI, info);
+        if (RegInserterReport)
+          errs() << "reg_inserter: " << F.getName() << ": estimated cost before "
+                 << cost_before << ", after " << cost_after << "\n";
+      } else {
+        declarated_functions.reset(call_sites.num_callees());
+        if (LI)
+          find_hoisted(F, DT, *LI);
 
-    #if ALGORITHM == STACK_IMP
-      changed |= stack_based_imp(dTree, info);
-    #elif ALGORITHM == DFS_IMP
-      changed |= DFS_based_imp(dTree->getRootNode(), info);
-    #endif
-    
-    delete dTree;
+        switch (RegInserterAlgorithm) {
+        case STACK_IMP:
+          changed |= stack_based_imp(&DT, info);
+          break;
+        case DFS_IMP:
+          changed |= DFS_based_imp(DT.getRootNode(), info);
+          break;
+        case INTERVAL_IMP:
+          changed |= interval_based_imp(DT, info);
+          break;
+        }
+      }
+      if (recording) {
+        cached.n_inserted = n_inserted;
+        cached.n_merged = n_merged;
+        cached.n_hoisted = n_hoisted;
+        cached.n_elided = n_elided;
+        cached.n_cold = n_cold;
+        ResultCache(RegInserterCacheDir).store(key, cached);
+        recording = nullptr;
+      }
+    }
+    ORE = nullptr;
+    if (!counted.empty())
+      emit_counters(F, profile_key, info);
+    NumInserted += n_inserted;
+    NumElided += n_elided;
+    NumMerged += n_merged;
+    NumHoisted += n_hoisted;
+    NumProfileCold += n_cold;
+
+    if (RegInserterReport) {
+      errs() << "reg_inserter: " << F.getName() << ": inserted " << n_inserted
+             << ", merged " << n_merged << ", hoisted " << n_hoisted;
+      if (!RegInserterProfile.empty())
+        errs() << ", kept at never executed calls " << n_cold
+               << (profiled ? "" : " (not in the profile)");
+      errs() << "\n";
+    }
+
+    if (changed || instrumented) {
+      F.addFnAttr(reg_inserter_instrumented);
+      changed = true;
+    }
     return changed;
   }
+}; // end of struct RegInserterImpl
+
+struct RegInserter : public FunctionPass {
+  static char ID;
+  RegInserter() : FunctionPass(ID) {
+    // используемые анализы и их зависимости должны быть зарегистрированы
+    // и тогда, когда проход запускается не из opt
+    initializeCore(*PassRegistry::getPassRegistry());
+    initializeAnalysis(*PassRegistry::getPassRegistry());
+  }
+
+  void getAnalysisUsage(AnalysisUsage &AU) const override {
+    AU.addRequired<DominatorTreeWrapperPass>();
+    if (RegInserterHoistLoops)
+      AU.addRequired<LoopInfoWrapperPass>();
+    if (RegInserterFrequencyPlacement)
+      AU.addRequired<BlockFrequencyInfoWrapperPass>();
+    // вставляются только инструкции, граф потока управления не меняется
+    AU.setPreservesCFG();
+  }
+
+  // legacy менеджер строит требуемые анализы до запуска прохода,
+  // поэтому при попадании в кэш здесь экономится только обход
+  bool runOnFunction(Function &F) override {
+    auto DT = [&]() -> DominatorTree& { return getAnalysis<DominatorTreeWrapperPass>().getDomTree(); };
+    auto LI = [&]() -> LoopInfo& { return getAnalysis<LoopInfoWrapperPass>().getLoopInfo(); };
+    auto BFI = [&]() -> BlockFrequencyInfo& { return getAnalysis<BlockFrequencyInfoWrapperPass>().getBFI(); };
+    RegInserterImpl impl;
+    impl.module_info = &module_info;
+    return impl.run(F, {DT, LI, BFI});
+  }
+
+  // после модуля его объявления больше не нужны
+  bool doFinalization(Module &M) override {
+    module_info = RegInserterModuleInfo();
+    return false;
+  }
+
+  RegInserterModuleInfo module_info;
 }; // end of struct RegInserter
+
+// может ли функция напрямую обратиться к цепочке x28: чтение или запись
+// регистра или переменной цепочки (в том числе уже вставленные
+// последовательности) или ассемблер
+static bool touches_register(const Function& F)
+{
+  for (const BasicBlock& BB : F)
+    for (const Instruction& I : BB)
+      if (const Value* ptr = getLoadStorePointerOperand(&I)) {
+        auto GV = dyn_cast<GlobalVariable>(ptr->stripPointerCasts());
+        if (GV && GV->getName() == reg_inserter_chain)
+          return true;
+      } else if (auto CB = dyn_cast<CallBase>(&I)) {
+        if (CB->isInlineAsm())
+          return true;
+        if (auto II = dyn_cast<IntrinsicInst>(CB))
+          if (II->getIntrinsicID() == Intrinsic::read_register ||
+              II->getIntrinsicID() == Intrinsic::write_register)
+            return true;
+      }
+  return false;
+}
+
+// обходим граф вызовов по компонентам сильной связности снизу вверх;
+// компонента "чистая", если ни одна ее функция не обращается к x28 и не
+// вызывает неизвестных, внешних или "грязных" функций
+static DenseSet<const Function*> find_clean_functions(CallGraph& CG)
+{
+  DenseSet<const Function*> clean;
+  for (auto scc = scc_begin(&CG); !scc.isAtEnd(); ++scc) {
+    SmallPtrSet<const Function*, 4> members;
+    for (CallGraphNode* N : *scc)
+      members.insert(N->getFunction());
+    bool dirty = false;
+    for (CallGraphNode* N : *scc) {
+      const Function* F = N->getFunction();
+      if (F && F->isIntrinsic())
+        continue;
+      // внешний узел, внешние объявления, заменяемые при линковке функции
+      // main и точки входа потоков (инициализируют x28) считаем обращающимися
+      // к регистру
+      if (!F || F->isDeclaration() || F->isInterposable() ||
+          F->getName() == "main" || is_thread_entry(*F) || touches_register(*F)) {
+        dirty = true;
+        break;
+      }
+      for (auto& edge : *N) {
+        const Function* callee = edge.second->getFunction();
+        // косвенный вызов ведет во внешний узел без функции
+        if (!callee || (!members.count(callee) && !callee->isIntrinsic() && !clean.count(callee))) {
+          dirty = true;
+          break;
+        }
+      }
+      if (dirty)
+        break;
+    }
+    if (!dirty)
+      clean.insert(members.begin(), members.end());
+  }
+  return clean;
+}
+
+static void report_clean_functions(Module& M, const DenseSet<const Function*>& clean, unsigned n_elided)
+{
+  if (!RegInserterReport)
+    return;
+  unsigned n_defined = 0;
+  for (Function& F : M)
+    n_defined += !F.isDeclaration();
+  errs() << "reg_inserter: " << M.getName() << ": clean functions " << clean.size()
+         << " (defined " << n_defined << "), elided calls " << n_elided << "\n";
+}
+
+// межпроцедурный режим: вызовы функций, не обращающихся к x28, пропускаются
+struct RegInserterIPO : public ModulePass {
+  static char ID;
+  RegInserterIPO() : ModulePass(ID) {
+    initializeCore(*PassRegistry::getPassRegistry());
+    initializeAnalysis(*PassRegistry::getPassRegistry());
+  }
+
+  void getAnalysisUsage(AnalysisUsage &AU) const override {
+    AU.addRequired<CallGraphWrapperPass>();
+    AU.addRequired<DominatorTreeWrapperPass>();
+    if (RegInserterHoistLoops)
+      AU.addRequired<LoopInfoWrapperPass>();
+    if (RegInserterFrequencyPlacement)
+      AU.addRequired<BlockFrequencyInfoWrapperPass>();
+    AU.setPreservesCFG();
+  }
+
+  bool runOnModule(Module &M) override {
+    bool changed = mark_thread_entries(M);
+    unsigned n_elided = 0;
+    DenseSet<const Function*> clean =
+        find_clean_functions(getAnalysis<CallGraphWrapperPass>().getCallGraph());
+    RegInserterModuleInfo module_info;
+    for (Function& F : M) {
+      if (F.isDeclaration())
+        continue;
+      // анализы функции модульного прохода строятся по запросу
+      auto DT = [&]() -> DominatorTree& { return getAnalysis<DominatorTreeWrapperPass>(F).getDomTree(); };
+      auto LI = [&]() -> LoopInfo& { return getAnalysis<LoopInfoWrapperPass>(F).getLoopInfo(); };
+      auto BFI = [&]() -> BlockFrequencyInfo& { return getAnalysis<BlockFrequencyInfoWrapperPass>(F).getBFI(); };
+      RegInserterImpl impl;
+      impl.clean_functions = &clean;
+      impl.module_info = &module_info;
+      changed |= impl.run(F, {DT, LI, BFI});
+      n_elided += impl.call_sites.num_skipped();
+    }
+    report_clean_functions(M, clean, n_elided);
+    return changed;
+  }
+}; // end of struct RegInserterIPO
+
+// Поздняя чистка: после встраивания, SimplifyCFG и DCE часть последовательностей
+// стоит перед вызовами, которых больше нет, а часть после слияния блоков
+// оказалась под доминирующей последовательностью той же функции. Обход
+// дерева доминаторов повторяется по уже оптимизированному IR: вызов
+// обслуживает ближайшая доминирующая последовательность с его функцией в
+// метаданных reg_inserter.callee (или более ранний вызов той же функции),
+// последовательность, не обслужившая ни одного вызова, удаляется.
+// Последовательности косвенных вызовов ("indirect") и init_chain не трогаются.
+struct RegInserterCleanupImpl {
+  CallSiteTable call_sites;
+  SequenceWalker walker;
+
+  unsigned n_orphaned = 0;
+  unsigned n_redundant = 0;
+
+  // запись цепочки удаляется вместе с ее чтением и преобразованиями
+  static void erase_sequence(Instruction* write)
+  {
+    Value* value = isa<StoreInst>(write) ? cast<StoreInst>(write)->getValueOperand()
+                                         : cast<CallInst>(write)->getArgOperand(1);
+    write->eraseFromParent();
+    RecursivelyDeleteTriviallyDeadInstructions(value);
+  }
+
+  bool run(Function& F, DominatorTree& DT)
+  {
+    unsigned tag_kind = F.getContext().getMDKindID(reg_inserter_callee_md);
+    call_sites.scan(F);
+    SmallVector<Instruction*, 16> sequences;
+    SmallPtrSet<Instruction*, 16> needed;
+    // последовательности, у которых остался хотя бы один вызов их функций
+    SmallPtrSet<Instruction*, 16> has_calls;
+    walker.walk(DT, call_sites, tag_kind,
+      [&](Instruction&, Instruction* by) {
+        if (by && by->getMetadata(tag_kind))
+          needed.insert(by);
+      },
+      [&](Instruction& write, bool indirect, bool calls_left) {
+        sequences.push_back(&write);
+        if (indirect)
+          needed.insert(&write);
+        if (calls_left)
+          has_calls.insert(&write);
+      });
+    for (Instruction* write : sequences) {
+      if (needed.count(write))
+        continue;
+      if (has_calls.count(write))
+        n_redundant++;
+      else
+        n_orphaned++;
+      erase_sequence(write);
+    }
+    NumCleanupOrphaned += n_orphaned;
+    NumCleanupRedundant += n_redundant;
+    if (RegInserterReport)
+      errs() << "reg_inserter_cleanup: " << F.getName() << ": orphaned " << n_orphaned
+             << ", redundant " << n_redundant << ", kept " << needed.size() << "\n";
+    return n_orphaned || n_redundant;
+  }
+};
+
+struct RegInserterCleanup : public FunctionPass {
+  static char ID;
+  RegInserterCleanup() : FunctionPass(ID) {
+    initializeCore(*PassRegistry::getPassRegistry());
+    initializeAnalysis(*PassRegistry::getPassRegistry());
+  }
+
+  void getAnalysisUsage(AnalysisUsage &AU) const override {
+    AU.addRequired<DominatorTreeWrapperPass>();
+    // удаляются только инструкции, граф потока управления не меняется
+    AU.setPreservesCFG();
+  }
+
+  bool runOnFunction(Function &F) override {
+    return RegInserterCleanupImpl().run(F, getAnalysis<DominatorTreeWrapperPass>().getDomTree());
+  }
+}; // end of struct RegInserterCleanup
 }  // end of anonymous namespace
 
+// в новом менеджере дерево доминаторов строится лениво, внутри прохода;
+// legacy менеджер сам отмечает в трассе каждый проход, включая построение дерева
+static DominatorTree& get_dom_tree(Function& F, FunctionAnalysisManager& FAM)
+{
+  TimeTraceScope scope("RegInserterDomTree", F.getName());
+  return FAM.getResult<DominatorTreeAnalysis>(F);
+}
+
+PreservedAnalyses RegInserterPass::run(Function &F, FunctionAnalysisManager &FAM)
+{
+  auto DT = [&]() -> DominatorTree& { return get_dom_tree(F, FAM); };
+  auto LI = [&]() -> LoopInfo& { return FAM.getResult<LoopAnalysis>(F); };
+  auto BFI = [&]() -> BlockFrequencyInfo& { return FAM.getResult<BlockFrequencyAnalysis>(F); };
+  if (!module_info)
+    module_info = std::make_shared<RegInserterModuleInfo>();
+  RegInserterImpl impl;
+  impl.module_info = module_info.get();
+  if (!impl.run(F, {DT, LI, BFI}))
+    return PreservedAnalyses::all();
+  PreservedAnalyses PA;
+  PA.preserveSet<CFGAnalyses>();
+  return PA;
+}
+
+PreservedAnalyses RegInserterIPOPass::run(Module &M, ModuleAnalysisManager &MAM)
+{
+  FunctionAnalysisManager& FAM = MAM.getResult<FunctionAnalysisManagerModuleProxy>(M).getManager();
+  bool changed = mark_thread_entries(M);
+  DenseSet<const Function*> clean = find_clean_functions(MAM.getResult<CallGraphAnalysis>(M));
+  unsigned n_elided = 0;
+  RegInserterModuleInfo module_info;
+  PreservedAnalyses FPA;
+  FPA.preserveSet<CFGAnalyses>();
+  for (Function& F : M) {
+    if (F.isDeclaration())
+      continue;
+    auto DT = [&]() -> DominatorTree& { return get_dom_tree(F, FAM); };
+    auto LI = [&]() -> LoopInfo& { return FAM.getResult<LoopAnalysis>(F); };
+    auto BFI = [&]() -> BlockFrequencyInfo& { return FAM.getResult<BlockFrequencyAnalysis>(F); };
+    RegInserterImpl impl;
+    impl.clean_functions = &clean;
+    impl.module_info = &module_info;
+    if (impl.run(F, {DT, LI, BFI})) {
+      FAM.invalidate(F, FPA);
+      changed = true;
+    }
+    n_elided += impl.call_sites.num_skipped();
+  }
+  report_clean_functions(M, clean, n_elided);
+  if (!changed)
+    return PreservedAnalyses::all();
+  // анализы функций уже обновлены выше
+  PreservedAnalyses PA;
+  PA.preserveSet<AllAnalysesOn<Function>>();
+  PA.preserve<FunctionAnalysisManagerModuleProxy>();
+  return PA;
+}
+
+PreservedAnalyses RegInserterCleanupPass::run(Function &F, FunctionAnalysisManager &FAM)
+{
+  if (!RegInserterCleanupImpl().run(F, FAM.getResult<DominatorTreeAnalysis>(F)))
+    return PreservedAnalyses::all();
+  PreservedAnalyses PA;
+  PA.preserveSet<CFGAnalyses>();
+  return PA;
+}
+
 char RegInserter::ID = 0;
 static RegisterPass<RegInserter> X("reg_inserter", "RegInserter Pass",
                                    false /* Only looks at CFG */,
                                    false /* Analysis Pass */);
 
+char RegInserterIPO::ID = 0;
+static RegisterPass<RegInserterIPO> XIPO("reg_inserter_ipo",
+                                         "RegInserter Pass (skips callees that never observe x28)",
+                                         false /* Only looks at CFG */,
+                                         false /* Analysis Pass */);
+
+char RegInserterCleanup::ID = 0;
+static RegisterPass<RegInserterCleanup> XCleanup("reg_inserter_cleanup",
+                                                 "RegInserter cleanup (deletes orphaned and redundant sequences)",
+                                                 false /* Only looks at CFG */,
+                                                 false /* Analysis Pass */);
+
+// опции разбираются раньше, чем строится конвейер, поэтому проход
+// регистрируется во всех точках, а добавляется только в выбранной
 static RegisterStandardPasses Y(
     PassManagerBuilder::EP_EarlyAsPossible,
     [](const PassManagerBuilder &Builder,
-       legacy::PassManagerBase &PM) { PM.add(new RegInserter()); });
+       legacy::PassManagerBase &PM) {
+      if (RegInserterEP == EARLY_EP)
+        PM.add(new RegInserter());
+    });
+
+static RegisterStandardPasses YScalarLate(
+    PassManagerBuilder::EP_ScalarOptimizerLate,
+    [](const PassManagerBuilder &Builder,
+       legacy::PassManagerBase &PM) {
+      if (RegInserterEP == SCALAR_LATE_EP)
+        PM.add(new RegInserter());
+    });
+
+static RegisterStandardPasses YOptimizerLast(
+    PassManagerBuilder::EP_OptimizerLast,
+    [](const PassManagerBuilder &Builder,
+       legacy::PassManagerBase &PM) {
+      if (RegInserterEP == OPTIMIZER_LAST_EP)
+        PM.add(new RegInserter());
+      if (RegInserterRunCleanup)
+        PM.add(new RegInserterCleanup());
+    });
+
+// на -O0 поздних точек нет, но программа все равно должна получить
+// последовательности
+static RegisterStandardPasses YOptLevel0(
+    PassManagerBuilder::EP_EnabledOnOptLevel0,
+    [](const PassManagerBuilder &Builder,
+       legacy::PassManagerBase &PM) {
+      if (RegInserterEP != EARLY_EP)
+        PM.add(new RegInserter());
+    });
 
 
 llvm::FunctionPass* createRegInserterPass()
 {
   return new RegInserter();
 }
+
+llvm::FunctionPass* createRegInserterCleanupPass()
+{
+  return new RegInserterCleanup();
+}
+
+extern "C" LLVM_ATTRIBUTE_WEAK PassPluginLibraryInfo llvmGetPassPluginInfo()
+{
+  return {
+    LLVM_PLUGIN_API_VERSION, "RegInserter", LLVM_VERSION_STRING,
+    [](PassBuilder &PB) {
+      // opt -load-pass-plugin ./reg_inserter.so -passes=reg-inserter
+      PB.registerPipelineParsingCallback(
+        [](StringRef Name, FunctionPassManager &FPM,
+           ArrayRef<PassBuilder::PipelineElement>) {
+          if (Name != "reg-inserter")
+            return false;
+          FPM.addPass(RegInserterPass());
+          return true;
+        });
+      // opt -load-pass-plugin ./reg_inserter.so -passes=reg-inserter-cleanup
+      PB.registerPipelineParsingCallback(
+        [](StringRef Name, FunctionPassManager &FPM,
+           ArrayRef<PassBuilder::PipelineElement>) {
+          if (Name != "reg-inserter-cleanup")
+            return false;
+          FPM.addPass(RegInserterCleanupPass());
+          return true;
+        });
+      // opt -load-pass-plugin ./reg_inserter.so -passes=reg-inserter-ipo
+      PB.registerPipelineParsingCallback(
+        [](StringRef Name, ModulePassManager &MPM,
+           ArrayRef<PassBuilder::PipelineElement>) {
+          if (Name != "reg-inserter-ipo")
+            return false;
+          MPM.addPass(RegInserterIPOPass());
+          return true;
+        });
+      // clang -fpass-plugin=./reg_inserter.so, точки соответствуют
+      // -reg-inserter-ep; уровень оптимизации передается в callback
+      // не во всех версиях LLVM
+      PB.registerPipelineStartEPCallback(
+        [](ModulePassManager &MPM, auto...) {
+          if (RegInserterEP == EARLY_EP)
+            MPM.addPass(createModuleToFunctionPassAdaptor(RegInserterPass()));
+        });
+      PB.registerScalarOptimizerLateEPCallback(
+        [](FunctionPassManager &FPM, auto...) {
+          if (RegInserterEP == SCALAR_LATE_EP)
+            FPM.addPass(RegInserterPass());
+        });
+      PB.registerOptimizerLastEPCallback(
+        [](ModulePassManager &MPM, auto...) {
+          if (RegInserterEP == OPTIMIZER_LAST_EP)
+            MPM.addPass(createModuleToFunctionPassAdaptor(RegInserterPass()));
+          if (RegInserterRunCleanup)
+            MPM.addPass(createModuleToFunctionPassAdaptor(RegInserterCleanupPass()));
+        });
+    }
+  };
+}
@@ -0,0 +1,166 @@
+#ifndef REG_INSERTER_H
+#define REG_INSERTER_H
+
+#include "llvm/Pass.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/PassManager.h"
+#include "llvm/Support/CommandLine.h"
+
+#include <memory>
+
+/*
+    \brief  Реализация обхода дерева доминаторов, выбирается опцией
+            -reg-inserter-algorithm=stack|dfs|interval. Значение по
+            умолчанию можно задать при сборке через -DALGORITHM=...
+*/
+enum TraversalAlgorithm { STACK_IMP, DFS_IMP, INTERVAL_IMP };
+#ifndef ALGORITHM
+#define ALGORITHM STACK_IMP
+#endif
+
+extern llvm::cl::opt<TraversalAlgorithm> RegInserterAlgorithm;
+
+/*
+    \brief  Где хранится указатель цепочки, выбирается опцией
+            -reg-inserter-lowering=register|thread-local|global.
+            Регистр требует сборки всей программы с зарезервированным
+            регистром, переменные - нет, но каждое обращение к ним идет
+            через память; обычная глобальная переменная годится только
+            для однопоточных программ.
+*/
+enum ChainLowering { REGISTER_LOWERING, THREAD_LOCAL_LOWERING, GLOBAL_LOWERING };
+
+extern llvm::cl::opt<ChainLowering> RegInserterLowering;
+
+/*
+    \brief  Имя переменной цепочки для -reg-inserter-lowering=thread-local|global.
+*/
+const char* const reg_inserter_chain = "__reg_inserter_chain";
+
+/*
+    \brief  Режим -reg-inserter-coalesce: последовательные первые вызовы
+            внутри блока разделяют одну вставленную последовательность,
+            если между ними нет записи в память.
+*/
+extern llvm::cl::opt<bool> RegInserterCoalesce;
+
+/*
+    \brief  Каталог кэша результатов (-reg-inserter-cache-dir), пустая
+            строка - кэш выключен. См. result_cache.h.
+*/
+extern llvm::cl::opt<std::string> RegInserterCacheDir;
+
+/*
+    \brief  Метаданные на записи цепочки (llvm.write_register или store)
+            каждой вставленной последовательности: функции, вызовы
+            которых она обслуживает (несколько - при -reg-inserter-coalesce),
+            строка "indirect" - косвенный вызов. По ним поздний проход
+            reg_inserter_cleanup находит последовательности после
+            оптимизаций.
+*/
+const char* const reg_inserter_callee_md = "reg_inserter.callee";
+
+/*
+    \brief  Атрибут функции, уже обработанной проходом: повторный запуск
+            (например, и при компиляции, и при LTO) пропускает ее за O(1).
+*/
+const char* const reg_inserter_instrumented = "reg_inserter.instrumented";
+
+/*
+    \brief  Метаданные на записи цепочки x28 = &y в прологе точки входа
+            (main или потока): пролог, вставленный раньше, не дублируется,
+            даже если атрибут reg_inserter_instrumented потерян.
+*/
+const char* const reg_inserter_init_md = "reg_inserter.init";
+
+/*
+    \brief  Аннотация точки входа потока, которую нельзя найти по вызову
+            pthread_create: __attribute__((annotate("reg_inserter.thread_entry"))),
+            и атрибут, которым mark_thread_entries отмечает все точки входа.
+            Такая функция, как и main, заводит собственную цепочку.
+*/
+const char* const reg_inserter_thread_entry = "reg_inserter.thread_entry";
+
+/*
+    \brief   Отмечает атрибутом reg_inserter_thread_entry точки входа потоков
+             модуля: start routine pthread_create, функции с аннотацией
+             reg_inserter_thread_entry и из -reg-inserter-thread-entry.
+    \details Проход по функциям сам узнает точку входа по ее использованиям
+             и модуль не меняет; отметку ставят межпроцедурный проход и
+             драйвер, который делит модуль на части, - до разбиения, иначе
+             точка входа в другой части, чем вызов pthread_create, не будет
+             найдена.
+    \return  true, если модуль изменен.
+*/
+bool mark_thread_entries(llvm::Module& M);
+
+/*
+    \brief  Точка входа потока: функция с атрибутом reg_inserter_thread_entry
+            или одна из тех, что отметила бы mark_thread_entries.
+*/
+bool is_thread_entry(const llvm::Function& F);
+
+/*
+    \brief  Регистр цепочки модуля: из -reg-inserter-register или по
+            умолчанию для платформы (x28 на AArch64, x27 на RISC-V);
+            пустая строка - на платформе регистр зарезервировать нельзя.
+*/
+llvm::StringRef reserved_register(const llvm::Module& M);
+
+struct RegInserterModuleInfo;
+
+/*
+    \brief   Версия прохода RegInserter для нового менеджера проходов.
+    \details Дерево доминаторов берется из FunctionAnalysisManager,
+             поэтому уже построенное дерево переиспользуется. Проход
+             не меняет CFG, поэтому CFG-анализы помечаются сохраненными.
+             Регистр цепочки и объявления интринсиков ищутся один раз на
+             модуль и хранятся в объекте прохода (module_info); другой
+             модуль заменяет их.
+*/
+struct RegInserterPass : public llvm::PassInfoMixin<RegInserterPass>
+{
+    llvm::PreservedAnalyses run(llvm::Function& F, llvm::FunctionAnalysisManager& FAM);
+
+    std::shared_ptr<RegInserterModuleInfo> module_info;
+};
+
+/*
+    \brief   Межпроцедурный режим RegInserter для нового менеджера проходов.
+    \details Граф вызовов обходится по компонентам сильной связности, и
+             для вызовов функций, которые даже транзитивно не обращаются
+             к x28 и не вызывают неизвестного кода, последовательность
+             не вставляется.
+*/
+struct RegInserterIPOPass : public llvm::PassInfoMixin<RegInserterIPOPass>
+{
+    llvm::PreservedAnalyses run(llvm::Module& M, llvm::ModuleAnalysisManager& MAM);
+};
+
+/*
+    \brief   Поздняя чистка последовательностей RegInserter для нового
+             менеджера проходов (-passes=reg-inserter-cleanup).
+    \details После оптимизаций по метаданным reg_inserter.callee заново
+             выполняется дедупликация по дереву доминаторов: удаляются
+             последовательности, вызовов функций которых не осталось, и
+             последовательности, над которыми доминирует другая
+             последовательность или вызов тех же функций. В legacy
+             менеджере - проход reg_inserter_cleanup, в конвейер -O
+             добавляется опцией -reg-inserter-cleanup.
+*/
+struct RegInserterCleanupPass : public llvm::PassInfoMixin<RegInserterCleanupPass>
+{
+    llvm::PreservedAnalyses run(llvm::Function& F, llvm::FunctionAnalysisManager& FAM);
+};
+
+/*
+    \brief  Создает проход RegInserter для legacy менеджера проходов.
+*/
+llvm::FunctionPass* createRegInserterPass();
+
+/*
+    \brief  Создает проход reg_inserter_cleanup для legacy менеджера проходов.
+*/
+llvm::FunctionPass* createRegInserterCleanupPass();
+
+#endif // REG_INSERTER_H
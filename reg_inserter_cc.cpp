@@ -0,0 +1,302 @@
+// Пакетный драйвер сборки с RegInserter.
+//
+// Каждый входной файл (.c, .bc или .ll) компилируется в объектный файл
+// в своем LLVMContext на пуле потоков: проход RegInserter и кодогенерация
+// через TargetMachine выполняются внутри процесса, IR между этапами не
+// печатается и не разбирается заново. Из внешних процессов остается
+// только фронтенд для .c: clang -emit-llvm -c в временный .bc (заголовков
+// clang для встраивания фронтенда среди зависимостей нет).
+//
+// Использование: reg_inserter_cc [-j N] [-cc clang-11] [-cflags "..."]
+//                                [-mtriple T] [-mattr +reserve-x28] [-O N]
+//                                [-relocation-model pic|static]
+//                                [-filetype obj|asm] [-ipo] [-time]
+//                                [опции прохода] <inputs> (-o <output> | -output-dir <dir>)
+
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/Config/llvm-config.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IRReader/IRReader.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/Host.h"
+#include "llvm/Support/InitLLVM.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/Program.h"
+#include "llvm/Support/SourceMgr.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/ToolOutputFile.h"
+#include "llvm/Target/TargetMachine.h"
+#include "llvm/Target/TargetOptions.h"
+#if LLVM_VERSION_MAJOR < 14
+#include "llvm/Support/TargetRegistry.h"
+#else
+#include "llvm/MC/TargetRegistry.h"
+#endif
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "reg_inserter.h"
+
+using namespace llvm;
+
+static cl::list<std::string> InputFilenames(
+    cl::Positional, cl::desc("<inputs: .c, .bc or .ll>"), cl::OneOrMore);
+
+static cl::opt<std::string> OutputFilename(
+    "o", cl::desc("Output file (a single input only)"), cl::value_desc("filename"));
+
+static cl::opt<std::string> OutputDir(
+    "output-dir",
+    cl::desc("Directory of the outputs <input stem>.o (.s); default: current directory"),
+    cl::value_desc("directory"));
+
+static cl::opt<unsigned> Threads(
+    "j", cl::desc("Number of files compiled at once (0 - one per core)"),
+    cl::init(0));
+
+static cl::opt<std::string> CCompiler(
+    "cc", cl::desc("C frontend, run as <cc> <cflags> -emit-llvm -c"),
+    cl::value_desc("program"), cl::init("clang"));
+
+static cl::opt<std::string> CFlags(
+    "cflags", cl::desc("Space separated flags of the C frontend"),
+    cl::value_desc("flags"));
+
+static cl::opt<std::string> TargetTriple(
+    "mtriple", cl::desc("Target triple (default: the triple of the module)"),
+    cl::value_desc("triple"));
+
+static cl::opt<std::string> TargetFeatures(
+    "mattr", cl::desc("Target features of functions without target-features, "
+                      "e.g. +reserve-x28 for modules not built by clang -ffixed-x28"),
+    cl::value_desc("features"));
+
+static cl::opt<char> OptLevel(
+    "O", cl::desc("Code generation optimization level (0-3)"), cl::Prefix,
+    cl::ZeroOrMore, cl::init('2'));
+
+static cl::opt<Reloc::Model> RelocModel(
+    "relocation-model", cl::desc("Relocation model"),
+    cl::values(clEnumValN(Reloc::PIC_, "pic", "position independent code"),
+               clEnumValN(Reloc::Static, "static", "non-relocatable code")),
+    cl::init(Reloc::PIC_));
+
+static cl::opt<CodeGenFileType> FileType(
+    "filetype", cl::desc("Output file type"),
+    cl::values(clEnumValN(CGFT_ObjectFile, "obj", "object file"),
+               clEnumValN(CGFT_AssemblyFile, "asm", "assembly")),
+    cl::init(CGFT_ObjectFile));
+
+static cl::opt<bool> IPO(
+    "ipo", cl::desc("Run the interprocedural mode of the pass"), cl::init(false));
+
+static cl::opt<bool> ReportTime(
+    "time", cl::desc("Print per-file stage times and the total wall-clock time to stderr"),
+    cl::init(false));
+
+// один входной файл; потоки пишут только в свое задание
+struct Job
+{
+  std::string input;
+  std::string output;
+  std::string error;
+  double frontend_time = 0;
+  double pass_time = 0;
+  double codegen_time = 0;
+};
+
+static double seconds_since(std::chrono::steady_clock::time_point start)
+{
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// clang -emit-llvm -c во временный файл; пустая строка - ошибка в job.error
+static std::string run_frontend(Job& job)
+{
+  auto cc = sys::findProgramByName(CCompiler);
+  if (!cc) {
+    job.error = "cannot find " + CCompiler + ": " + cc.getError().message();
+    return "";
+  }
+  SmallString<128> bitcode;
+  if (std::error_code EC = sys::fs::createTemporaryFile("reg_inserter_cc", "bc", bitcode)) {
+    job.error = "cannot create a temporary file: " + EC.message();
+    return "";
+  }
+  SmallVector<StringRef, 16> flags;
+  SplitString(CFlags, flags);
+  std::vector<StringRef> args{*cc};
+  args.insert(args.end(), flags.begin(), flags.end());
+  args.insert(args.end(), {"-emit-llvm", "-c", "-o", bitcode, job.input});
+  std::string message;
+  if (sys::ExecuteAndWait(*cc, args, None, {}, 0, 0, &message)) {
+    sys::fs::remove(bitcode);
+    job.error = CCompiler + " failed" + (message.empty() ? "" : ": " + message);
+    return "";
+  }
+  return std::string(bitcode);
+}
+
+// проход над модулем: RegInserterPass над каждой функцией или RegInserterIPOPass
+static void run_pass(Module& M)
+{
+  PassBuilder PB;
+  LoopAnalysisManager LAM;
+  FunctionAnalysisManager FAM;
+  CGSCCAnalysisManager CGAM;
+  ModuleAnalysisManager MAM;
+  PB.registerModuleAnalyses(MAM);
+  PB.registerCGSCCAnalyses(CGAM);
+  PB.registerFunctionAnalyses(FAM);
+  PB.registerLoopAnalyses(LAM);
+  PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+
+  ModulePassManager MPM;
+  if (IPO)
+    MPM.addPass(RegInserterIPOPass());
+  else
+    MPM.addPass(createModuleToFunctionPassAdaptor(RegInserterPass()));
+  MPM.run(M, MAM);
+}
+
+// кодогенерация как у llc: TargetMachine на каждое задание, поэтому
+// потоки не разделяют ни контекст, ни объекты цели
+static bool run_codegen(Module& M, Job& job)
+{
+  std::string triple = TargetTriple.empty() ? M.getTargetTriple() : TargetTriple;
+  if (triple.empty())
+    triple = sys::getDefaultTargetTriple();
+  std::string message;
+  const Target* target = TargetRegistry::lookupTarget(triple, message);
+  if (!target) {
+    job.error = message;
+    return false;
+  }
+  CodeGenOpt::Level level = CodeGenOpt::Default;
+  switch (OptLevel) {
+  case '0': level = CodeGenOpt::None; break;
+  case '1': level = CodeGenOpt::Less; break;
+  case '3': level = CodeGenOpt::Aggressive; break;
+  }
+  std::unique_ptr<TargetMachine> TM(target->createTargetMachine(
+      triple, "", TargetFeatures, TargetOptions(), Optional<Reloc::Model>(RelocModel), None, level));
+  M.setTargetTriple(triple);
+  M.setDataLayout(TM->createDataLayout());
+
+  std::error_code EC;
+  ToolOutputFile out(job.output, EC,
+                     FileType == CGFT_AssemblyFile ? sys::fs::OF_Text : sys::fs::OF_None);
+  if (EC) {
+    job.error = job.output + ": " + EC.message();
+    return false;
+  }
+  legacy::PassManager PM;
+  if (TM->addPassesToEmitFile(PM, out.os(), nullptr, FileType)) {
+    job.error = "target '" + triple + "' cannot emit this file type";
+    return false;
+  }
+  PM.run(M);
+  out.keep();
+  return true;
+}
+
+static void compile(Job& job)
+{
+  auto start = std::chrono::steady_clock::now();
+  std::string path = job.input;
+  bool from_c = sys::path::extension(job.input) == ".c";
+  if (from_c) {
+    path = run_frontend(job);
+    if (path.empty())
+      return;
+  }
+  LLVMContext C;
+  SMDiagnostic Err;
+  std::unique_ptr<Module> M = parseIRFile(path, Err, C);
+  if (from_c)
+    sys::fs::remove(path);
+  if (!M) {
+    raw_string_ostream os(job.error);
+    Err.print("", os, false);
+    return;
+  }
+  job.frontend_time = seconds_since(start);
+
+  start = std::chrono::steady_clock::now();
+  run_pass(*M);
+  job.pass_time = seconds_since(start);
+
+  start = std::chrono::steady_clock::now();
+  run_codegen(*M, job);
+  job.codegen_time = seconds_since(start);
+}
+
+int main(int argc, char** argv)
+{
+  InitLLVM X(argc, argv);
+  InitializeAllTargetInfos();
+  InitializeAllTargets();
+  InitializeAllTargetMCs();
+  InitializeAllAsmPrinters();
+  InitializeAllAsmParsers();
+  cl::ParseCommandLineOptions(argc, argv, "batch RegInserter compile driver\n");
+
+  if (!OutputFilename.empty() && InputFilenames.size() != 1) {
+    errs() << argv[0] << ": -o needs a single input, use -output-dir\n";
+    return 1;
+  }
+  std::vector<Job> jobs(InputFilenames.size());
+  for (size_t i = 0; i < jobs.size(); i++) {
+    jobs[i].input = InputFilenames[i];
+    if (!OutputFilename.empty()) {
+      jobs[i].output = OutputFilename;
+      continue;
+    }
+    SmallString<128> output(OutputDir);
+    sys::path::append(output, sys::path::stem(jobs[i].input));
+    output += FileType == CGFT_AssemblyFile ? ".s" : ".o";
+    jobs[i].output = std::string(output);
+  }
+
+  if (!OutputDir.empty())
+    if (std::error_code EC = sys::fs::create_directories(OutputDir)) {
+      errs() << argv[0] << ": " << OutputDir << ": " << EC.message() << "\n";
+      return 1;
+    }
+
+  auto start = std::chrono::steady_clock::now();
+  unsigned n_threads = Threads ? Threads : hardware_concurrency().compute_thread_count();
+  {
+    ThreadPool pool(hardware_concurrency(n_threads));
+    for (Job& job : jobs)
+      pool.async([&job] { compile(job); });
+    pool.wait();
+  }
+  double total_time = seconds_since(start);
+
+  int status = 0;
+  for (const Job& job : jobs) {
+    if (!job.error.empty()) {
+      errs() << argv[0] << ": " << job.input << ": " << job.error << "\n";
+      status = 1;
+      continue;
+    }
+    if (ReportTime)
+      errs() << "reg_inserter_cc: " << job.input << ": frontend " << format("%.3f", job.frontend_time)
+             << " s, pass " << format("%.3f", job.pass_time) << " s, codegen "
+             << format("%.3f", job.codegen_time) << " s\n";
+  }
+  if (ReportTime)
+    errs() << "reg_inserter_cc: " << jobs.size() << " files, threads " << n_threads
+           << ", wall " << format("%.3f", total_time) << " s\n";
+  return status;
+}
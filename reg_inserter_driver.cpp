@@ -0,0 +1,493 @@
+// Параллельный драйвер RegInserter для больших модулей.
+//
+// Модуль делится на части через SplitModule, каждая часть обрабатывается
+// проходом в своем LLVMContext на пуле потоков, затем части линкуются
+// обратно в один модуль. Порядок глобальных объектов восстанавливается по
+// исходному модулю, а созданных проходом - по функциям, при обработке
+// которых они появились, поэтому результат совпадает с последовательным
+// запуском (-j 1 или -partitions 1).
+//
+// Использование: reg_inserter_driver [-j N] [-partitions P] [-time]
+//                                    [-time-trace-file trace.json]
+//                                    [-reg-inserter-cache-dir dir]
+//                                    [опции прохода] <input> -o <output.bc>
+
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/ADT/StringSet.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/Config/llvm-config.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IRReader/IRReader.h"
+#include "llvm/Linker/Linker.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/InitLLVM.h"
+#include "llvm/Support/SourceMgr.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/TimeProfiler.h"
+#include "llvm/Support/ToolOutputFile.h"
+#include "llvm/Transforms/Utils/SplitModule.h"
+
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include "reg_inserter.h"
+#include "result_cache.h"
+
+using namespace llvm;
+
+static cl::opt<std::string> InputFilename(
+    cl::Positional, cl::desc("<input module>"), cl::init("-"));
+
+static cl::opt<std::string> OutputFilename(
+    "o", cl::desc("Output bitcode file"), cl::value_desc("filename"),
+    cl::init("-"));
+
+static cl::opt<unsigned> Threads(
+    "j", cl::desc("Number of worker threads (0 - one per core)"),
+    cl::init(0));
+
+static cl::opt<unsigned> Partitions(
+    "partitions",
+    cl::desc("Number of module partitions (0 - one per worker thread)"),
+    cl::init(0));
+
+static cl::opt<bool> ReportTime(
+    "time", cl::desc("Print split/run/link times to stderr"), cl::init(false));
+
+static cl::opt<std::string> TimeTraceFile(
+    "time-trace-file",
+    cl::desc("Write a Chrome trace with the RegInserter regions of every thread"),
+    cl::value_desc("filename"));
+
+static cl::opt<unsigned> TimeTraceGranularity(
+    "time-trace-granularity",
+    cl::desc("Minimum time granularity (in microseconds) traced by the time profiler"),
+    cl::init(500));
+
+// неименованные объекты на время разбиения получают имена с этим
+// префиксом, иначе их нельзя сопоставить с исходным порядком
+static const char* const unnamed_prefix = "__reg_inserter_unnamed.";
+
+static double seconds_since(std::chrono::steady_clock::time_point start)
+{
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+static std::string write_bitcode(const Module& M)
+{
+  std::string buffer;
+  raw_string_ostream os(buffer);
+  WriteBitcodeToFile(M, os);
+  os.flush();
+  return buffer;
+}
+
+static std::unique_ptr<Module> read_bitcode(const std::string& buffer, LLVMContext& C)
+{
+  return cantFail(parseBitcodeFile(MemoryBufferRef(buffer, "partition"), C));
+}
+
+// RegInserterPass над каждой функцией модуля; after вызывается после
+// обработки каждой функции
+static void run_pass(Module& M, function_ref<void(Function&)> after = nullptr)
+{
+  PassBuilder PB;
+  LoopAnalysisManager LAM;
+  FunctionAnalysisManager FAM;
+  CGSCCAnalysisManager CGAM;
+  ModuleAnalysisManager MAM;
+  PB.registerModuleAnalyses(MAM);
+  PB.registerCGSCCAnalyses(CGAM);
+  PB.registerFunctionAnalyses(FAM);
+  PB.registerLoopAnalyses(LAM);
+  PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+
+  // функции обходятся вручную, а не адаптором, чтобы после каждой из них
+  // можно было увидеть созданные ею объекты; объявления, которые проход
+  // добавляет в конец списка, тоже попадают в обход и пропускаются
+  FunctionPassManager FPM;
+  FPM.addPass(RegInserterPass());
+  for (Function& F : M) {
+    if (F.isDeclaration())
+      continue;
+    FPM.run(F, FAM);
+    if (after)
+      after(F);
+  }
+}
+
+// объект, созданный проходом в части: при обработке какой функции (номер
+// в исходном порядке) и каким по счету в части он появился
+struct Created
+{
+  std::string name;
+  unsigned owner;
+  unsigned seq;
+  bool appending;
+};
+
+// Новые объекты, которые проход создал при обработке очередной функции.
+// Проход только добавляет объекты в конец списков, поэтому они ищутся с
+// конца до первого уже известного. Исключение - llvm.compiler.used с
+// appending linkage: appendToCompilerUsed пересоздает его, и он считается
+// созданным функцией, которая изменила его инициализатор
+class CreatedTracker
+{
+public:
+  CreatedTracker(Module& M, const StringMap<unsigned>& order, std::vector<Created>& created)
+      : order(order), created(created)
+  {
+    for (GlobalValue& GV : M.global_values())
+      note(GV);
+  }
+
+  void after(Function& F)
+  {
+    unsigned owner = order.lookup(F.getName());
+    Module& M = *F.getParent();
+    collect(M.getFunctionList(), owner);
+    collect(M.getGlobalList(), owner);
+    for (auto& entry : appending) {
+      GlobalVariable* GV = M.getNamedGlobal(entry.getKey());
+      const Constant* init = GV && GV->hasInitializer() ? GV->getInitializer() : nullptr;
+      if (init == entry.getValue())
+        continue;
+      entry.setValue(init);
+      if (init)
+        created.push_back({entry.getKey().str(), owner, seq++, true});
+    }
+  }
+
+private:
+  void note(GlobalValue& GV)
+  {
+    if (auto* V = dyn_cast<GlobalVariable>(&GV))
+      if (V->hasAppendingLinkage()) {
+        appending[V->getName()] = V->hasInitializer() ? V->getInitializer() : nullptr;
+        return;
+      }
+    known.insert(&GV);
+  }
+
+  template <typename ListT>
+  void collect(ListT& list, unsigned owner)
+  {
+    std::vector<GlobalValue*> fresh;
+    for (auto it = list.rbegin(); it != list.rend(); ++it) {
+      if (auto* V = dyn_cast<GlobalVariable>(&*it))
+        if (V->hasAppendingLinkage()) {
+          appending.try_emplace(V->getName(), nullptr);
+          continue;
+        }
+      if (known.count(&*it))
+        break;
+      fresh.push_back(&*it);
+    }
+    for (auto it = fresh.rbegin(); it != fresh.rend(); ++it) {
+      note(**it);
+      created.push_back({(*it)->getName().str(), owner, seq++, false});
+    }
+  }
+
+  const StringMap<unsigned>& order;
+  std::vector<Created>& created;
+  DenseSet<const GlobalValue*> known;
+  StringMap<const Constant*> appending;
+  unsigned seq = 0;
+};
+
+// часть модуля обрабатывается в собственном контексте, поэтому потоки
+// не разделяют никаких объектов LLVM
+static void process_partition(std::string& bitcode, const StringMap<unsigned>& order,
+                              std::vector<Created>& created)
+{
+  if (!TimeTraceFile.empty())
+    timeTraceProfilerInitialize(TimeTraceGranularity, "reg_inserter_driver");
+  {
+    LLVMContext C;
+    std::unique_ptr<Module> M = read_bitcode(bitcode, C);
+    CreatedTracker tracker(*M, order, created);
+    run_pass(*M, [&](Function& F) { tracker.after(F); });
+    bitcode = write_bitcode(*M);
+  }
+  if (!TimeTraceFile.empty())
+    timeTraceProfilerFinishThread();
+}
+
+static int write_time_trace(const char* argv0)
+{
+  if (TimeTraceFile.empty())
+    return 0;
+  Error E = timeTraceProfilerWrite(TimeTraceFile, OutputFilename);
+  timeTraceProfilerCleanup();
+  if (E) {
+    errs() << argv0 << ": " << toString(std::move(E)) << "\n";
+    return 1;
+  }
+  return 0;
+}
+
+static void report_cache()
+{
+  if (ReportTime && !RegInserterCacheDir.empty())
+    errs() << "reg_inserter_driver: cache hits " << ResultCache::hits() << ", misses "
+           << ResultCache::misses() << "\n";
+}
+
+// SplitModule копирует в каждую часть именованные метаданные и ассемблер
+// уровня модуля, а линковщик их склеивает; оставляем их только в первой части
+static void strip_module_level(Module& M)
+{
+  M.setModuleInlineAsm("");
+  std::vector<NamedMDNode*> named;
+  for (NamedMDNode& NMD : M.named_metadata())
+    if (NMD.getName() != "llvm.module.flags")
+      named.push_back(&NMD);
+  for (NamedMDNode* NMD : named)
+    M.eraseNamedMetadata(NMD);
+}
+
+// Место объекта в последовательном запуске. Исходные объекты идут в
+// исходном порядке, за ними созданные проходом: в порядке функций, при
+// обработке которых они появились, а внутри функции - в порядке создания.
+// Общий для нескольких функций объект последовательный запуск создает при
+// первой из них, а пересоздаваемый appending - при последней. Объекты,
+// появление которых не отслежено, остаются в конце в порядке линковки
+struct OrderKey
+{
+  const StringMap<unsigned>& order;
+  const StringMap<Created>& created;
+
+  std::tuple<unsigned, unsigned, unsigned> operator()(const GlobalValue* V) const
+  {
+    auto it = order.find(V->getName());
+    if (it != order.end())
+      return {0, it->second, 0};
+    auto c = created.find(V->getName());
+    if (c != created.end())
+      return {1, c->second.owner, c->second.seq};
+    return {2, 0, 0};
+  }
+};
+
+// переставляет объекты списка в порядке key
+template <typename ListT>
+static void restore_order(ListT& list, const OrderKey& key)
+{
+  using ValueT = typename ListT::value_type;
+  std::vector<ValueT*> values;
+  for (ValueT& V : list)
+    values.push_back(&V);
+  std::stable_sort(values.begin(), values.end(),
+                   [&](const ValueT* a, const ValueT* b) { return key(a) < key(b); });
+  for (ValueT* V : values)
+    list.splice(list.end(), list, V->getIterator());
+}
+
+// Линковщик склеивает массивы llvm.used и llvm.compiler.used частей
+// подряд, а последовательный запуск дописывает в них элементы по мере
+// обработки функций. Исходные элементы возвращаются на свои места
+// (positions), добавленные проходом идут за ними в порядке key
+static void restore_used_order(Module& M, StringRef name, const StringMap<unsigned>& positions,
+                               const OrderKey& key)
+{
+  GlobalVariable* GV = M.getNamedGlobal(name);
+  if (!GV || !GV->hasInitializer())
+    return;
+  auto* init = dyn_cast<ConstantArray>(GV->getInitializer());
+  if (!init)
+    return;
+  auto element_key = [&](Constant* C) {
+    auto* V = dyn_cast<GlobalValue>(C->stripPointerCasts());
+    if (!V)
+      return std::make_tuple(3u, 0u, 0u);
+    auto it = positions.find(V->getName());
+    if (it != positions.end())
+      return std::make_tuple(0u, it->second, 0u);
+    auto k = key(V);
+    return std::make_tuple(std::get<0>(k) + 1, std::get<1>(k), std::get<2>(k));
+  };
+  std::vector<Constant*> elements;
+  for (Use& U : init->operands())
+    elements.push_back(cast<Constant>(U.get()));
+  std::stable_sort(elements.begin(), elements.end(),
+                   [&](Constant* a, Constant* b) { return element_key(a) < element_key(b); });
+  GV->setInitializer(ConstantArray::get(init->getType(), elements));
+}
+
+// части читаются в общий контекст линковки, и структура получает суффикс
+// .N, если ее имя в контексте уже занято: например, типом неиспользуемого
+// объявления из другой части, которое линковщик не переносит. Возвращаем
+// структурам результата имена names исходного модуля
+static void restore_type_names(Module& M, const StringSet<>& names)
+{
+  std::vector<StructType*> types = M.getIdentifiedStructTypes();
+  DenseSet<StructType*> used(types.begin(), types.end());
+  for (StructType* T : types) {
+    if (!T->hasName() || names.count(T->getName()))
+      continue;
+    std::pair<StringRef, StringRef> name = T->getName().rsplit('.');
+    if (name.second.empty() || !all_of(name.second, isDigit) || !names.count(name.first))
+      continue;
+#if LLVM_VERSION_MAJOR < 12
+    StructType* holder = M.getTypeByName(name.first);
+#else
+    StructType* holder = StructType::getTypeByName(M.getContext(), name.first);
+#endif
+    if (holder && used.count(holder))
+      continue;
+    if (holder)
+      holder->setName("");
+    T->setName(name.first);
+  }
+}
+
+int main(int argc, char** argv)
+{
+  InitLLVM X(argc, argv);
+  cl::ParseCommandLineOptions(argc, argv, "parallel RegInserter driver\n");
+
+  LLVMContext Context;
+  SMDiagnostic Err;
+  std::unique_ptr<Module> M = parseIRFile(InputFilename, Err, Context);
+  if (!M) {
+    Err.print(argv[0], errs());
+    return 1;
+  }
+
+  if (!TimeTraceFile.empty())
+    timeTraceProfilerInitialize(TimeTraceGranularity, "reg_inserter_driver");
+
+  // вызов pthread_create и его точка входа могут попасть в разные части
+  mark_thread_entries(*M);
+
+  unsigned n_threads = Threads ? Threads : hardware_concurrency().compute_thread_count();
+  unsigned n_parts = Partitions ? Partitions : n_threads;
+
+  std::error_code EC;
+  ToolOutputFile Out(OutputFilename, EC, sys::fs::OF_None);
+  if (EC) {
+    errs() << argv[0] << ": " << EC.message() << "\n";
+    return 1;
+  }
+
+  // последовательный запуск: весь модуль целиком
+  if (n_threads == 1 || n_parts == 1) {
+    auto start = std::chrono::steady_clock::now();
+    run_pass(*M);
+    if (ReportTime)
+      errs() << "reg_inserter_driver: serial run " << seconds_since(start) << " s\n";
+    report_cache();
+    WriteBitcodeToFile(*M, Out.os());
+    Out.keep();
+    return write_time_trace(argv[0]);
+  }
+
+  // запоминаем исходный порядок глобальных объектов
+  StringMap<unsigned> order;
+  std::vector<std::string> unnamed;
+  for (GlobalValue& GV : M->global_values()) {
+    if (!GV.hasName()) {
+      unnamed.push_back(unnamed_prefix + std::to_string(unnamed.size()));
+      GV.setName(unnamed.back());
+    }
+    order[GV.getName()] = order.size();
+  }
+  StringMap<unsigned> used_positions[2];
+  const char* const used_names[2] = {"llvm.used", "llvm.compiler.used"};
+  for (unsigned i = 0; i < 2; i++)
+    if (GlobalVariable* used = M->getNamedGlobal(used_names[i]))
+      if (auto* init = dyn_cast_or_null<ConstantArray>(used->getInitializer()))
+        for (Use& U : init->operands())
+          if (auto* V = dyn_cast<GlobalValue>(U.get()->stripPointerCasts()))
+            used_positions[i].try_emplace(V->getName(), used_positions[i].size());
+  StringSet<> type_names;
+  for (StructType* T : M->getIdentifiedStructTypes())
+    if (T->hasName())
+      type_names.insert(T->getName());
+  std::string identifier = M->getModuleIdentifier();
+  std::string source_file = M->getSourceFileName();
+
+  auto start = std::chrono::steady_clock::now();
+  std::vector<std::string> parts;
+  auto collect = [&](std::unique_ptr<Module> part) {
+    if (!parts.empty())
+      strip_module_level(*part);
+    parts.push_back(write_bitcode(*part));
+  };
+  // локальные объекты не делаются внешними, а попадают в часть
+  // вместе со всеми своими пользователями
+#if LLVM_VERSION_MAJOR < 12
+  SplitModule(std::move(M), n_parts, collect, /*PreserveLocals=*/true);
+#else
+  SplitModule(*M, n_parts, collect, /*PreserveLocals=*/true);
+  M.reset();
+#endif
+  double split_time = seconds_since(start);
+
+  start = std::chrono::steady_clock::now();
+  std::vector<std::vector<Created>> created_in(parts.size());
+  {
+    ThreadPool pool(hardware_concurrency(n_threads));
+    for (unsigned i = 0; i < parts.size(); i++)
+      pool.async([&, i] { process_partition(parts[i], order, created_in[i]); });
+    pool.wait();
+  }
+  double run_time = seconds_since(start);
+
+  // линкуем в новый контекст, чтобы у именованных структур
+  // не появлялись суффиксы из-за типов исходного модуля
+  start = std::chrono::steady_clock::now();
+  LLVMContext LinkContext;
+  auto Result = std::make_unique<Module>(identifier, LinkContext);
+  Result->setSourceFileName(source_file);
+  Linker L(*Result);
+  for (const std::string& part : parts) {
+    std::unique_ptr<Module> P = read_bitcode(part, LinkContext);
+    if (L.linkInModule(std::move(P))) {
+      errs() << argv[0] << ": failed to link partitions\n";
+      return 1;
+    }
+  }
+  // объекты, добавленные проходом (интринсики, счетчики и строки
+  // -reg-inserter-counters), идут после исходных в том порядке, в котором
+  // их создал бы последовательный запуск; линковщик же переносит их в
+  // порядке обращений
+  StringMap<Created> created;
+  for (const std::vector<Created>& part_created : created_in)
+    for (const Created& c : part_created) {
+      auto it = created.try_emplace(c.name, c).first;
+      if (c.appending ? it->second.owner < c.owner : c.owner < it->second.owner)
+        it->second = c;
+    }
+  OrderKey key{order, created};
+  restore_order(Result->getGlobalList(), key);
+  restore_order(Result->getFunctionList(), key);
+  restore_order(Result->getAliasList(), key);
+  restore_order(Result->getIFuncList(), key);
+  for (unsigned i = 0; i < 2; i++)
+    restore_used_order(*Result, used_names[i], used_positions[i], key);
+  for (const std::string& name : unnamed)
+    if (GlobalValue* GV = Result->getNamedValue(name))
+      GV->setName("");
+  restore_type_names(*Result, type_names);
+  double link_time = seconds_since(start);
+
+  if (ReportTime)
+    errs() << "reg_inserter_driver: threads " << n_threads << ", partitions " << parts.size()
+           << ", split " << split_time << " s, run " << run_time << " s, link "
+           << link_time << " s\n";
+  report_cache();
+
+  WriteBitcodeToFile(*Result, Out.os());
+  Out.keep();
+  return write_time_trace(argv[0]);
+}
@@ -0,0 +1,233 @@
+// Машинная версия RegInserter для AArch64.
+//
+// Проход работает после выбора инструкций (MIR в SSA-форме) и видит только
+// настоящие вызовы BL/BLR: хвостовые вызовы уже стали TCRETURN*, встроенные
+// и удаленные вызовы исчезли. Перед первым вызовом каждой функции на пути
+// по дереву доминаторов (MachineDominatorTree) ставится одна инструкция
+// `ldr x28, [x28]` вместо цепочки read_register/inttoptr/load/ptrtoint/
+// write_register уровня IR.
+//
+// Использование (модуль собран с -ffixed-x28, IR-проход не запускался):
+//   llc -stop-after=finalize-isel x.ll -o x.mir
+//   llc -load ./reg_inserter.so -run-pass=reg-inserter-machine x.mir -o x.ri.mir
+//   llc -start-after=finalize-isel x.ri.mir -o x.s
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/DepthFirstIterator.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/ADT/Triple.h"
+#include "llvm/CodeGen/LowLevelType.h"
+#include "llvm/CodeGen/MachineDominators.h"
+#include "llvm/CodeGen/MachineFrameInfo.h"
+#include "llvm/CodeGen/MachineFunctionPass.h"
+#include "llvm/CodeGen/MachineInstrBuilder.h"
+#include "llvm/CodeGen/MachineRegisterInfo.h"
+#include "llvm/CodeGen/TargetInstrInfo.h"
+#include "llvm/CodeGen/TargetLowering.h"
+#include "llvm/CodeGen/TargetRegisterInfo.h"
+#include "llvm/CodeGen/TargetSubtargetInfo.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Module.h"
+#include "llvm/InitializePasses.h"
+#include "llvm/Target/TargetMachine.h"
+
+#include <utility>
+#include <vector>
+
+#include "reg_inserter.h"
+#include "callee_availability.h"
+
+using namespace llvm;
+
+#define DEBUG_TYPE "reg-inserter-machine"
+
+STATISTIC(NumMachineCalls, "Number of BL/BLR calls seen by the machine pass");
+STATISTIC(NumMachineInserted, "Number of ldr x28, [x28] inserted by the machine pass");
+
+namespace {
+struct RegInserterMachine : public MachineFunctionPass {
+  static char ID;
+  RegInserterMachine() : MachineFunctionPass(ID) {
+    initializeMachineDominatorTreePass(*PassRegistry::getPassRegistry());
+  }
+
+  void getAnalysisUsage(AnalysisUsage &AU) const override {
+    AU.addRequired<MachineDominatorTree>();
+    AU.addPreserved<MachineDominatorTree>();
+    // вставляются только инструкции, граф потока управления не меняется
+    AU.setPreservesCFG();
+    MachineFunctionPass::getAnalysisUsage(AU);
+  }
+
+  StringRef getPassName() const override { return "RegInserter (AArch64 MIR)"; }
+
+  // коды инструкций AArch64 ищутся по именам: заголовки бэкенда не
+  // устанавливаются вместе с LLVM; ноль - инструкции нет
+  struct Opcodes
+  {
+    unsigned LDRXui = 0;
+    unsigned STRXui = 0;
+    unsigned ADDXri = 0;
+    unsigned BL = 0;
+    unsigned BLR = 0;
+    unsigned BLRNoIP = 0;
+  };
+  Opcodes ops;
+  const TargetInstrInfo* cached_for = nullptr;
+
+  void find_opcodes(const TargetInstrInfo& TII)
+  {
+    if (cached_for == &TII)
+      return;
+    cached_for = &TII;
+    ops = Opcodes();
+    std::pair<StringRef, unsigned*> names[] = {
+      {"LDRXui", &ops.LDRXui}, {"STRXui", &ops.STRXui}, {"ADDXri", &ops.ADDXri},
+      {"BL", &ops.BL}, {"BLR", &ops.BLR}, {"BLRNoIP", &ops.BLRNoIP}};
+    for (unsigned opcode = 0; opcode < TII.getNumOpcodes(); opcode++)
+      for (auto& name : names)
+        if (TII.getName(opcode) == name.first)
+          *name.second = opcode;
+  }
+
+  // вызываемая функция: глобальный объект у BL, виртуальный регистр с
+  // адресом у BLR (в SSA одно значение - один регистр); вызовы
+  // библиотечных функций, порожденных кодогенерацией (memcpy и т.п.),
+  // соответствуют интринсикам и пропускаются, как и в IR-проходе
+  using CalleeKey = std::pair<const GlobalValue*, unsigned>;
+
+  bool callee_of(const MachineInstr& MI, CalleeKey& key) const
+  {
+    unsigned opcode = MI.getOpcode();
+    if (!opcode || MI.getNumOperands() == 0)
+      return false;
+    const MachineOperand& target = MI.getOperand(0);
+    if (opcode == ops.BL) {
+      if (!target.isGlobal())
+        return false;
+      auto F = dyn_cast<Function>(target.getGlobal());
+      if (F && F->isIntrinsic())
+        return false;
+      key = {target.getGlobal(), 0};
+      return true;
+    }
+    if ((opcode == ops.BLR || opcode == ops.BLRNoIP) && target.isReg()) {
+      key = {nullptr, target.getReg()};
+      return true;
+    }
+    return false;
+  }
+
+  // ldr x28, [x28]; volatile, чтобы MachineCSE и MachineLICM не
+  // объединяли и не выносили последовательности
+  void insert_load(MachineBasicBlock& MBB, MachineBasicBlock::iterator I,
+                   Register reg, const TargetInstrInfo& TII)
+  {
+    MachineFunction& MF = *MBB.getParent();
+    MachineMemOperand* MMO = MF.getMachineMemOperand(
+        MachinePointerInfo(), MachineMemOperand::MOLoad | MachineMemOperand::MOVolatile,
+        8, Align(8));
+    BuildMI(MBB, I, DebugLoc(), TII.get(ops.LDRXui), reg)
+        .addReg(reg)
+        .addImm(0)
+        .addMemOperand(MMO);
+  }
+
+  // точка входа (main или поток) заводит собственную цепочку, как
+  // init_chain IR-прохода: y = &y, x28 = &y, перед выходом x28 восстанавливается
+  void init_chain(MachineFunction& MF, Register reg, const TargetInstrInfo& TII)
+  {
+    MachineRegisterInfo& MRI = MF.getRegInfo();
+    const TargetRegisterInfo& TRI = *MF.getSubtarget().getRegisterInfo();
+    MachineBasicBlock& entry = MF.front();
+    MachineBasicBlock::iterator I = entry.begin();
+    DebugLoc DL;
+
+    Register saved = MRI.createVirtualRegister(TRI.getMinimalPhysRegClass(reg));
+    BuildMI(entry, I, DL, TII.get(TargetOpcode::COPY), saved).addReg(reg);
+    int slot = MF.getFrameInfo().CreateStackObject(8, Align(8), false);
+    Register addr = MRI.createVirtualRegister(TII.getRegClass(TII.get(ops.ADDXri), 0, &TRI, MF));
+    BuildMI(entry, I, DL, TII.get(ops.ADDXri), addr).addFrameIndex(slot).addImm(0).addImm(0);
+    Register value = MRI.createVirtualRegister(TII.getRegClass(TII.get(ops.STRXui), 0, &TRI, MF));
+    BuildMI(entry, I, DL, TII.get(TargetOpcode::COPY), value).addReg(addr);
+    BuildMI(entry, I, DL, TII.get(ops.STRXui)).addReg(value).addFrameIndex(slot).addImm(0);
+    BuildMI(entry, I, DL, TII.get(TargetOpcode::COPY), reg).addReg(addr);
+
+    // блоки выхода, в том числе с хвостовым вызовом TCRETURN*
+    for (MachineBasicBlock& MBB : MF)
+      if (MBB.isReturnBlock())
+        BuildMI(MBB, MBB.getFirstTerminator(), DL, TII.get(TargetOpcode::COPY), reg).addReg(saved);
+  }
+
+  bool runOnMachineFunction(MachineFunction &MF) override {
+    const Function& F = MF.getFunction();
+    if (!MF.getTarget().getTargetTriple().isAArch64()) {
+      F.getContext().emitError("reg-inserter-machine: only AArch64 is supported, use the IR pass");
+      return false;
+    }
+    const TargetInstrInfo& TII = *MF.getSubtarget().getInstrInfo();
+    find_opcodes(TII);
+    if (!ops.LDRXui || !ops.STRXui || !ops.ADDXri || !ops.BL || !ops.BLR) {
+      F.getContext().emitError("reg-inserter-machine: AArch64 opcodes not found");
+      return false;
+    }
+
+    // собираем вызовы и выдаем функциям плотные индексы
+    DenseMap<CalleeKey, ScopedAvailability::CalleeId> ids;
+    DenseMap<const MachineBasicBlock*, std::vector<std::pair<MachineInstr*, unsigned>>> calls;
+    for (MachineBasicBlock& MBB : MF)
+      for (MachineInstr& MI : MBB) {
+        CalleeKey key;
+        if (!callee_of(MI, key))
+          continue;
+        unsigned id = ids.insert({key, ids.size()}).first->second;
+        calls[&MBB].push_back({&MI, id});
+        NumMachineCalls++;
+      }
+    bool entry = F.getName() == "main" || is_thread_entry(F);
+    if (!entry && ids.empty())
+      return false;
+
+    // регистр берется так же, как для llvm.read_register; бэкенд сам
+    // проверяет, что он зарезервирован
+    StringRef name = reserved_register(*F.getParent());
+    Register reg = MF.getSubtarget().getTargetLowering()->getRegisterByName(
+        name.str().c_str(), LLT::scalar(64), MF);
+    if (!reg) {
+      F.getContext().emitError("reg-inserter-machine: unknown register '" + name + "'");
+      return false;
+    }
+
+    bool changed = false;
+    if (entry) {
+      init_chain(MF, reg, TII);
+      changed = true;
+    }
+
+    // обход дерева доминаторов в порядке DFS, как stack_based_imp
+    ScopedAvailability declared;
+    declared.reset(ids.size());
+    MachineDominatorTree& MDT = getAnalysis<MachineDominatorTree>();
+    for (MachineDomTreeNode* node : depth_first(MDT.getRootNode())) {
+      declared.pop_to(node->getLevel());
+      auto it = calls.find(node->getBlock());
+      if (it == calls.end())
+        continue;
+      declared.push_scope(node->getLevel());
+      for (auto& call : it->second)
+        if (declared.declare(call.second)) {
+          insert_load(*node->getBlock(), call.first->getIterator(), reg, TII);
+          NumMachineInserted++;
+          changed = true;
+        }
+    }
+    return changed;
+  }
+}; // end of struct RegInserterMachine
+}  // end of anonymous namespace
+
+char RegInserterMachine::ID = 0;
+static RegisterPass<RegInserterMachine> XMachine("reg-inserter-machine",
+                                                 "RegInserter Pass (AArch64 MIR, ldr x28, [x28])",
+                                                 false /* Only looks at CFG */,
+                                                 false /* Analysis Pass */);
@@ -0,0 +1,91 @@
+// Среда исполнения режима -reg-inserter-counters.
+//
+// Проход кладет в секцию reg_inserter_sites по записи на функцию со
+// счетчиками мест вставки. При завершении программы (exit или возврат из
+// main) записи дописываются блоком в файл профиля из переменной окружения
+// REG_INSERTER_PROFILE, по умолчанию reg_inserter.prof в текущем каталоге;
+// формат описан у SiteProfile в site_profile.h. Файл открывается на
+// дописывание, поэтому несколько запусков складываются в один профиль.
+// Если задана переменная REG_INSERTER_SUMMARY, в stderr печатается еще и
+// число мест и общее число выполненных последовательностей запуска.
+// Счетчики увеличиваются без атомарных операций, как у clang
+// -fprofile-instr-generate: в многопоточных программах они приблизительны.
+//
+// Использование:
+//   opt -load ./reg_inserter.so -reg_inserter -reg-inserter-counters x.ll -o x.counters.ll
+//   clang x.counters.s reg_inserter_rt.c -o x.counters
+//   REG_INSERTER_PROFILE=x.prof ./x.counters
+//   opt -load ./reg_inserter.so -reg_inserter -reg-inserter-profile=x.prof ... x.ll
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// запись функции, см. emit_counters в reg_inserter.cpp
+struct reg_inserter_record
+{
+    uint8_t key[16];
+    const char* name;
+    uint64_t n_sites;
+    const uint32_t* calls;
+    const char* const* callees;
+    uint64_t* counters;
+};
+
+// границы секции задает компоновщик; без инструментированного кода их нет
+extern const struct reg_inserter_record __start_reg_inserter_sites[] __attribute__((weak));
+extern const struct reg_inserter_record __stop_reg_inserter_sites[] __attribute__((weak));
+
+static void write_le(FILE* out, uint64_t value, int size)
+{
+    for(int i = 0; i < size; i++)
+        fputc((value >> (8 * i)) & 0xff, out);
+}
+
+static void write_string(FILE* out, const char* str)
+{
+    size_t size = strlen(str);
+    write_le(out, size, 4);
+    fwrite(str, 1, size, out);
+}
+
+__attribute__((destructor))
+static void reg_inserter_dump(void)
+{
+    const struct reg_inserter_record* begin = __start_reg_inserter_sites;
+    const struct reg_inserter_record* end = __stop_reg_inserter_sites;
+    if(begin == end)
+        return;
+    const char* path = getenv("REG_INSERTER_PROFILE");
+    if(!path || !*path)
+        path = "reg_inserter.prof";
+    FILE* out = fopen(path, "ab");
+    if(!out)
+    {
+        perror(path);
+        return;
+    }
+    uint64_t n_sites = 0, n_executed = 0;
+    fputs("RIP1", out);
+    write_le(out, end - begin, 4);
+    for(const struct reg_inserter_record* record = begin; record != end; record++)
+    {
+        n_sites += record->n_sites;
+        fwrite(record->key, 1, sizeof(record->key), out);
+        write_string(out, record->name);
+        write_le(out, record->n_sites, 4);
+        for(uint64_t i = 0; i < record->n_sites; i++)
+        {
+            write_le(out, record->calls[i], 4);
+            write_string(out, record->callees[i]);
+            write_le(out, record->counters[i], 8);
+            n_executed += record->counters[i];
+        }
+    }
+    if(fclose(out))
+        perror(path);
+    if(getenv("REG_INSERTER_SUMMARY"))
+        fprintf(stderr, "reg_inserter: %llu sites, %llu executed sequences\n",
+                (unsigned long long)n_sites, (unsigned long long)n_executed);
+}
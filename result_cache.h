@@ -0,0 +1,461 @@
+#ifndef RESULT_CACHE_H
+#define RESULT_CACHE_H
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/InlineAsm.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/Metadata.h"
+#include "llvm/Support/Endian.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MD5.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/Process.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <atomic>
+#include <climits>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "reg_inserter.h"
+
+/*
+    \brief   Структурный хэш функции для кэша результатов RegInserter.
+    \details В хэш входит все, от чего зависят решения прохода: граф
+             потока управления, инструкции с типами и операндами, места
+             вызовов, атрибуты вызываемых функций (от них зависят
+             запись в память и оценка частот), метаданные !prof,
+             метаданные reg_inserter.callee последовательностей,
+             вставленных раньше, и счетчик входов функции. Значения
+             внутри функции кодируются порядковыми номерами, глобальные
+             объекты - именами, поэтому хэш не зависит ни от процесса,
+             ни от имен локальных значений.
+             Хэш стабилен между запусками: используется MD5, а не
+             llvm::hash_code.
+*/
+class FunctionHasher
+{
+    public:
+    using Key = llvm::MD5::MD5Result;
+
+    /*
+        \brief  Хэширует функцию F вместе со строкой options (опции
+                прохода и все, что проход узнает о модуле вне F).
+                clean - функции, вызовы которых пропускаются
+                межпроцедурным режимом (может быть nullptr).
+        \return Ключ кэша; инструкции F после этого доступны по
+                номерам через instruction() и index().
+    */
+    Key hash(const llvm::Function& F, llvm::StringRef options,
+             const llvm::DenseSet<const llvm::Function*>* clean)
+    {
+        m_ids.clear();
+        m_values.clear();
+        m_buffer.clear();
+        m_callee_kind = F.getContext().getMDKindID(reg_inserter_callee_md);
+        /* сначала нумеруем все значения: операнды phi и переходов
+           могут ссылаться вперед */
+        for(const llvm::Argument& A : F.args())
+            number(&A);
+        for(const llvm::BasicBlock& BB : F)
+        {
+            number(&BB);
+            for(const llvm::Instruction& I : BB)
+                number(&I);
+        }
+
+        add_string(options);
+        add_type(F.getFunctionType());
+        add_attributes(F.getAttributes().getAttributes(llvm::AttributeList::FunctionIndex));
+        add_metadata(F.getMetadata(llvm::LLVMContext::MD_prof));
+        /* границы блоков видны по терминаторам */
+        for(const llvm::BasicBlock& BB : F)
+            for(const llvm::Instruction& I : BB)
+                add_instruction(I, clean);
+
+        /* MD5 считается один раз по всему буферу: пословное обновление
+           обходится в разы дороже */
+        llvm::MD5 hash;
+        hash.update(llvm::makeArrayRef(m_buffer));
+        Key key;
+        hash.final(key);
+        return key;
+    }
+
+    /*
+        \brief  Номер инструкции функции, захэшированной последней.
+    */
+    uint32_t index(const llvm::Instruction* I) const
+    {
+        return m_ids.lookup(I);
+    }
+
+    /*
+        \brief  Инструкция функции, захэшированной последней, по номеру
+                (nullptr, если под этим номером не инструкция).
+    */
+    llvm::Instruction* instruction(uint32_t index) const
+    {
+        return index < m_values.size()
+             ? llvm::dyn_cast<llvm::Instruction>(const_cast<llvm::Value*>(m_values[index]))
+             : nullptr;
+    }
+
+    private:
+    /* аргументы, блоки и инструкции нумеруются подряд в порядке обхода */
+    void number(const llvm::Value* V)
+    {
+        m_ids[V] = m_values.size();
+        m_values.push_back(V);
+    }
+
+    void add_int(uint64_t value)
+    {
+        /* ULEB128: почти все числа (коды, номера) занимают один байт, а
+           время хэша пропорционально длине буфера */
+        do
+        {
+            uint8_t byte = value & 0x7f;
+            value >>= 7;
+            m_buffer.push_back(value ? byte | 0x80 : byte);
+        } while(value);
+    }
+
+    void add_apint(const llvm::APInt& value)
+    {
+        for(unsigned i = 0; i < value.getNumWords(); i++)
+            add_int(value.getRawData()[i]);
+    }
+
+    void add_string(llvm::StringRef str)
+    {
+        add_int(str.size());
+        m_buffer.append(str.bytes_begin(), str.bytes_end());
+    }
+
+    /* без getAsString: построение строк заметно дороже самого хэша;
+       строковый атрибут skip не хэшируется */
+    void add_attributes(llvm::AttributeSet attributes, llvm::StringRef skip = "")
+    {
+        add_int(attributes.getNumAttributes() - (!skip.empty() && attributes.hasAttribute(skip)));
+        for(const llvm::Attribute& A : attributes)
+        {
+            if(A.isStringAttribute())
+            {
+                if(A.getKindAsString() == skip)
+                    continue;
+                add_string(A.getKindAsString());
+                add_string(A.getValueAsString());
+                continue;
+            }
+            add_int(A.getKindAsEnum());
+            if(A.isIntAttribute())
+                add_int(A.getValueAsInt());
+            else if(A.isTypeAttribute())
+                add_type(A.getValueAsType());
+        }
+    }
+
+    void add_type(llvm::Type* T)
+    {
+        add_int(T->getTypeID());
+        if(auto IT = llvm::dyn_cast<llvm::IntegerType>(T))
+            return add_int(IT->getBitWidth());
+        if(auto PT = llvm::dyn_cast<llvm::PointerType>(T))
+            return add_int(PT->getAddressSpace());
+        /* именованные структуры могут быть рекурсивными, их достаточно имени */
+        if(auto ST = llvm::dyn_cast<llvm::StructType>(T))
+            if(ST->hasName())
+                return add_string(ST->getName());
+        add_int(T->getNumContainedTypes());
+        for(llvm::Type* contained : T->subtypes())
+            add_type(contained);
+        if(auto AT = llvm::dyn_cast<llvm::ArrayType>(T))
+            add_int(AT->getNumElements());
+        if(auto VT = llvm::dyn_cast<llvm::FixedVectorType>(T))
+            add_int(VT->getNumElements());
+        if(auto FT = llvm::dyn_cast<llvm::FunctionType>(T))
+            add_int(FT->isVarArg());
+    }
+
+    void add_metadata(const llvm::Metadata* MD)
+    {
+        if(auto S = llvm::dyn_cast_or_null<llvm::MDString>(MD))
+            return add_string(S->getString());
+        if(auto C = llvm::dyn_cast_or_null<llvm::ConstantAsMetadata>(MD))
+            return add_value(C->getValue());
+        auto N = llvm::dyn_cast_or_null<llvm::MDTuple>(MD);
+        if(!N)
+            return add_int(MD ? MD->getMetadataID() + 1 : 0);
+        add_int(N->getNumOperands());
+        for(const llvm::MDOperand& op : N->operands())
+            add_metadata(op.get());
+    }
+
+    void add_value(const llvm::Value* V)
+    {
+        /* значения функции - по номерам */
+        auto it = m_ids.find(V);
+        if(it != m_ids.end())
+        {
+            add_int(0);
+            return add_int(it->second);
+        }
+        add_int(V->getValueID() + 1);
+        add_type(V->getType());
+        if(auto GV = llvm::dyn_cast<llvm::GlobalValue>(V))
+            return add_string(GV->getName());
+        if(auto CI = llvm::dyn_cast<llvm::ConstantInt>(V))
+            return add_apint(CI->getValue());
+        if(auto FP = llvm::dyn_cast<llvm::ConstantFP>(V))
+            return add_apint(FP->getValueAPF().bitcastToAPInt());
+        if(auto CDS = llvm::dyn_cast<llvm::ConstantDataSequential>(V))
+            return add_string(CDS->getRawDataValues());
+        if(auto CE = llvm::dyn_cast<llvm::ConstantExpr>(V))
+            add_int(CE->isCompare() ? CE->getPredicate() : CE->getOpcode());
+        if(auto MV = llvm::dyn_cast<llvm::MetadataAsValue>(V))
+            return add_metadata(MV->getMetadata());
+        if(auto IA = llvm::dyn_cast<llvm::InlineAsm>(V))
+        {
+            add_string(IA->getAsmString());
+            return add_string(IA->getConstraintString());
+        }
+        /* агрегаты и константные выражения - по операндам */
+        if(auto C = llvm::dyn_cast<llvm::Constant>(V))
+        {
+            add_int(C->getNumOperands());
+            for(const llvm::Use& op : C->operands())
+                add_value(op.get());
+        }
+    }
+
+    void add_instruction(const llvm::Instruction& I, const llvm::DenseSet<const llvm::Function*>* clean)
+    {
+        add_int(I.getOpcode());
+        add_type(I.getType());
+        if(auto CI = llvm::dyn_cast<llvm::CmpInst>(&I))
+            add_int(CI->getPredicate());
+        add_int(I.getNumOperands());
+        for(const llvm::Use& op : I.operands())
+            add_value(op.get());
+        /* phi ссылаются на блоки не через операнды */
+        if(auto PN = llvm::dyn_cast<llvm::PHINode>(&I))
+            for(const llvm::BasicBlock* BB : PN->blocks())
+                add_value(BB);
+        add_int(I.mayWriteToMemory());
+        if(auto CB = llvm::dyn_cast<llvm::CallBase>(&I))
+        {
+            add_attributes(CB->getAttributes().getAttributes(llvm::AttributeList::FunctionIndex));
+            const llvm::Function* callee = CB->getCalledFunction();
+            /* отметка об обработке вызываемой функции зависит только от
+               того, обработана ли она раньше F (в другой части
+               reg_inserter_driver ее нет), на результат она не влияет */
+            if(callee)
+                add_attributes(callee->getAttributes().getAttributes(llvm::AttributeList::FunctionIndex),
+                               reg_inserter_instrumented);
+            add_int(clean && callee && clean->count(callee));
+        }
+        add_metadata(I.getMetadata(llvm::LLVMContext::MD_prof));
+        add_metadata(I.getMetadata(m_callee_kind));
+    }
+
+    llvm::SmallVector<uint8_t, 0> m_buffer;
+    llvm::DenseMap<const llvm::Value*, uint32_t> m_ids;
+    std::vector<const llvm::Value*> m_values;
+    unsigned m_callee_kind = 0;
+};
+
+/*
+    \brief   Кэш результатов RegInserter на диске для повторных сборок.
+    \details Для каждой функции хранятся места вставленных последовательностей
+             (номера инструкций в нумерации FunctionHasher, перед которыми
+             они стоят) и счетчики прохода, поэтому при попадании
+             последовательности вставляются повторно без дерева
+             доминаторов и обхода. Запись -
+             отдельный файл <ключ>.ric в каталоге кэша:
+
+                 "RIC3", ключ (16 байт), n_inserted, n_merged, n_hoisted,
+                 n_elided, n_cold, число мест, места {инструкция, функция, вид}
+
+             все числа - uint32 little-endian; функция - индекс в
+             CallSiteTable, ею помечается последовательность (метаданные
+             reg_inserter.callee). Место вида shared новой
+             последовательности не дает: функция дописывается в метаданные
+             последней вставленной. Запись пишется во
+             временный файл и атомарно переименовывается, поэтому
+             параллельные сборки с общим каталогом видят либо целую
+             запись, либо никакой; читается запись через отображение
+             файла в память.
+*/
+class ResultCache
+{
+    public:
+    /* at_call - последовательность перед вызовом, detached - вынесенная
+       из места вызова, shared - вызов разделяет предыдущую последовательность */
+    enum SiteKind : uint32_t { at_call, detached, shared };
+
+    struct Site
+    {
+        uint32_t at;     /* номер инструкции, перед которой стоит последовательность */
+        uint32_t callee; /* индекс функции в CallSiteTable */
+        SiteKind kind;
+    };
+
+    struct Entry
+    {
+        uint32_t n_inserted = 0;
+        uint32_t n_merged = 0;
+        uint32_t n_hoisted = 0;
+        uint32_t n_elided = 0;
+        uint32_t n_cold = 0;
+        std::vector<Site> sites;
+    };
+
+    /*
+        \brief  Число попаданий и промахов всех кэшей процесса.
+    */
+    static std::atomic<unsigned>& hits()
+    {
+        static std::atomic<unsigned> counter{0};
+        return counter;
+    }
+
+    static std::atomic<unsigned>& misses()
+    {
+        static std::atomic<unsigned> counter{0};
+        return counter;
+    }
+
+    explicit ResultCache(llvm::StringRef dir) : m_dir(dir) {}
+
+    /*
+        \brief  Читает запись с ключом key; false, если ее нет или она
+                повреждена.
+    */
+    bool lookup(const FunctionHasher::Key& key, Entry& entry) const
+    {
+        llvm::SmallString<128> path = entry_path(key);
+        int fd;
+        if(llvm::sys::fs::openFileForRead(path, fd))
+            return false;
+        bool found = false;
+        uint64_t size;
+        std::error_code EC = llvm::sys::fs::file_size(path, size);
+        if(!EC && size >= header_size)
+        {
+            llvm::sys::fs::mapped_file_region region(
+                llvm::sys::fs::convertFDToNativeFile(fd),
+                llvm::sys::fs::mapped_file_region::readonly, size, 0, EC);
+            if(!EC)
+                found = parse(llvm::StringRef(region.const_data(), size), key, entry);
+        }
+        llvm::sys::Process::SafelyCloseFileDescriptor(fd);
+        return found;
+    }
+
+    /*
+        \brief  Сохраняет запись с ключом key; ошибки ввода-вывода
+                игнорируются - кэш лишь ускоряет сборку.
+    */
+    void store(const FunctionHasher::Key& key, const Entry& entry) const
+    {
+        std::string buffer;
+        llvm::raw_string_ostream os(buffer);
+        os << "RIC3";
+        os.write(reinterpret_cast<const char*>(key.Bytes.data()), key.Bytes.size());
+        for(uint32_t value : {entry.n_inserted, entry.n_merged, entry.n_hoisted, entry.n_elided,
+                              entry.n_cold, static_cast<uint32_t>(entry.sites.size())})
+            write32(os, value);
+        for(const Site& site : entry.sites)
+        {
+            write32(os, site.at);
+            write32(os, site.callee);
+            write32(os, site.kind);
+        }
+        os.flush();
+
+        if(llvm::sys::fs::create_directories(m_dir))
+            return;
+        llvm::SmallString<128> model(m_dir);
+        llvm::sys::path::append(model, "%%%%%%%%%%%%.tmp");
+        llvm::SmallString<128> tmp;
+        int fd;
+        if(llvm::sys::fs::createUniqueFile(model, fd, tmp))
+            return;
+        {
+            llvm::raw_fd_ostream out(fd, /*shouldClose=*/true);
+            out << buffer;
+            out.close();
+            if(out.has_error())
+            {
+                out.clear_error();
+                llvm::sys::fs::remove(tmp);
+                return;
+            }
+        }
+        if(llvm::sys::fs::rename(tmp, entry_path(key)))
+            llvm::sys::fs::remove(tmp);
+    }
+
+    private:
+    enum : size_t { header_size = 4 + 16 + 6 * 4 };
+
+    llvm::SmallString<128> entry_path(const FunctionHasher::Key& key) const
+    {
+        llvm::SmallString<128> path(m_dir);
+        llvm::sys::path::append(path, key.digest() + ".ric");
+        return path;
+    }
+
+    static void write32(llvm::raw_ostream& os, uint32_t value)
+    {
+        char bytes[4];
+        llvm::support::endian::write32le(bytes, value);
+        os.write(bytes, sizeof(bytes));
+    }
+
+    static uint32_t read32(const char*& data)
+    {
+        uint32_t value = llvm::support::endian::read32le(data);
+        data += 4;
+        return value;
+    }
+
+    static bool parse(llvm::StringRef data, const FunctionHasher::Key& key, Entry& entry)
+    {
+        if(!data.startswith("RIC3") ||
+           data.substr(4, 16) != llvm::StringRef(reinterpret_cast<const char*>(key.Bytes.data()), 16))
+            return false;
+        const char* ptr = data.data() + 20;
+        entry.n_inserted = read32(ptr);
+        entry.n_merged = read32(ptr);
+        entry.n_hoisted = read32(ptr);
+        entry.n_elided = read32(ptr);
+        entry.n_cold = read32(ptr);
+        uint32_t n_sites = read32(ptr);
+        if(data.size() != header_size + uint64_t(n_sites) * 12)
+            return false;
+        entry.sites.resize(n_sites);
+        for(Site& site : entry.sites)
+        {
+            site.at = read32(ptr);
+            site.callee = read32(ptr);
+            uint32_t kind = read32(ptr);
+            if(kind > shared)
+                return false;
+            site.kind = static_cast<SiteKind>(kind);
+        }
+        return true;
+    }
+
+    std::string m_dir;
+};
+
+#endif // RESULT_CACHE_H
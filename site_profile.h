@@ -0,0 +1,209 @@
+#ifndef SITE_PROFILE_H
+#define SITE_PROFILE_H
+
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/Endian.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/MD5.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/*
+    \brief   Профиль мест вставки, записанный программой, собранной с
+             -reg-inserter-counters и reg_inserter_rt.c.
+    \details Каждое завершение программы дописывает в файл профиля блок
+
+                 "RIP1", число функций, функции {ключ (16 байт), имя,
+                 число мест, места {номер вызова, функция вызова, счетчик}}
+
+             числа - uint32, счетчики - uint64, все little-endian; строки -
+             длина uint32 и байты. Ключ - FunctionHasher::hash функции без
+             опций до работы прохода, номер вызова - номер инструкции в той
+             же нумерации (у последовательности, вынесенной в предзаголовок
+             или доминирующий блок, - номер терминатора блока), поэтому
+             место находится в том же IR, пока функция не изменилась. Счетчики одного места из нескольких
+             блоков (запусков программы) складываются.
+*/
+class SiteProfile
+{
+    public:
+    struct Site
+    {
+        std::string callee; /* имя функции или "indirect" */
+        uint64_t count = 0;
+    };
+
+    struct Function
+    {
+        std::string name;
+        /* места по номеру инструкции вызова */
+        std::map<uint32_t, Site> sites;
+    };
+
+    /*
+        \brief  Читает профиль из файла path.
+        \return false с описанием в error, если файла нет или он поврежден.
+    */
+    bool load(llvm::StringRef path, std::string& error)
+    {
+        auto buffer = llvm::MemoryBuffer::getFile(path);
+        if(!buffer)
+        {
+            error = buffer.getError().message();
+            return false;
+        }
+        const char* data = (*buffer)->getBufferStart();
+        const char* end = (*buffer)->getBufferEnd();
+        while(data != end)
+        {
+            uint32_t n_functions;
+            if(!take(data, end, 4) || llvm::StringRef(data - 4, 4) != "RIP1" ||
+               !read32(data, end, n_functions))
+            {
+                error = "bad profile block";
+                return false;
+            }
+            for(uint32_t i = 0; i < n_functions; i++)
+            {
+                uint32_t n_sites;
+                if(!take(data, end, 16))
+                {
+                    error = "truncated profile";
+                    return false;
+                }
+                Function& function = m_functions[llvm::StringRef(data - 16, 16)];
+                if(!read_string(data, end, function.name) || !read32(data, end, n_sites))
+                {
+                    error = "truncated profile";
+                    return false;
+                }
+                for(uint32_t j = 0; j < n_sites; j++)
+                {
+                    uint32_t call;
+                    std::string callee;
+                    if(!read32(data, end, call) || !read_string(data, end, callee) ||
+                       !take(data, end, 8))
+                    {
+                        error = "truncated profile";
+                        return false;
+                    }
+                    Site& site = function.sites[call];
+                    site.callee = callee;
+                    site.count += llvm::support::endian::read64le(data - 8);
+                }
+            }
+        }
+        return true;
+    }
+
+    /*
+        \brief  Места функции с ключом key, nullptr - функции нет в
+                профиле (или она изменилась).
+    */
+    const Function* find(const llvm::MD5::MD5Result& key) const
+    {
+        auto it = m_functions.find(key_string(key));
+        return it == m_functions.end() ? nullptr : &it->second;
+    }
+
+    /*
+        \brief  Печатает top мест с наибольшими счетчиками.
+    */
+    void print_hottest(llvm::raw_ostream& os, llvm::StringRef path, unsigned top) const
+    {
+        std::vector<std::pair<const Function*, const std::pair<const uint32_t, Site>*>> sites;
+        for(const auto& function : m_functions)
+            for(const auto& site : function.second.sites)
+                sites.push_back({&function.second, &site});
+        os << "reg_inserter: profile " << path << ": " << sites.size() << " sites in "
+           << m_functions.size() << " functions, hottest:\n";
+        top = std::min<size_t>(top, sites.size());
+        std::partial_sort(sites.begin(), sites.begin() + top, sites.end(),
+                          [](const auto& a, const auto& b) {
+                              return a.second->second.count > b.second->second.count;
+                          });
+        for(unsigned i = 0; i < top; i++)
+            os << llvm::format_decimal(sites[i].second->second.count, 14) << "  "
+               << sites[i].first->name << ": call #" << sites[i].second->first << " -> "
+               << sites[i].second->second.callee << "\n";
+    }
+
+    /*
+        \brief  Профиль из файла path, прочитанный один раз на процесс:
+                проход запускается для каждой функции, в драйвере - из
+                нескольких потоков. При чтении печатает top самых
+                горячих мест в errs().
+        \param  [out] first  true только у первого вызова для path, чтобы
+                             ошибка чтения сообщалась один раз
+        \return nullptr, если профиль не прочитан (описание в error).
+    */
+    static const SiteProfile* shared(llvm::StringRef path, unsigned top, std::string& error, bool& first)
+    {
+        struct Loaded
+        {
+            std::unique_ptr<SiteProfile> profile;
+            std::string error;
+        };
+        static std::mutex mutex;
+        static llvm::StringMap<Loaded> loaded;
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = loaded.try_emplace(path);
+        first = it.second;
+        Loaded& entry = it.first->second;
+        if(first)
+        {
+            entry.profile.reset(new SiteProfile());
+            if(!entry.profile->load(path, entry.error))
+                entry.profile.reset();
+            else if(top)
+                entry.profile->print_hottest(llvm::errs(), path, top);
+        }
+        error = entry.error;
+        return entry.profile.get();
+    }
+
+    private:
+    /* функции по ключу (16 байт MD5) */
+    llvm::StringMap<Function> m_functions;
+
+    static std::string key_string(const llvm::MD5::MD5Result& key)
+    {
+        return std::string(reinterpret_cast<const char*>(key.Bytes.data()), key.Bytes.size());
+    }
+
+    static bool take(const char*& data, const char* end, size_t size)
+    {
+        if(static_cast<size_t>(end - data) < size)
+            return false;
+        data += size;
+        return true;
+    }
+
+    static bool read32(const char*& data, const char* end, uint32_t& value)
+    {
+        if(!take(data, end, 4))
+            return false;
+        value = llvm::support::endian::read32le(data - 4);
+        return true;
+    }
+
+    static bool read_string(const char*& data, const char* end, std::string& str)
+    {
+        uint32_t size;
+        if(!read32(data, end, size) || !take(data, end, size))
+            return false;
+        str.assign(data - size, size);
+        return true;
+    }
+};
+
+#endif // SITE_PROFILE_H
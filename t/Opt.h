@@ -9,5 +9,4 @@
 #include "llvm/IR/LegacyPassManager.h"
 #include "llvm/Transforms/IPO/PassManagerBuilder.h"
 
-
-llvm::FunctionPass* createRegInserterPass();
+#include "../reg_inserter.h"
@@ -0,0 +1,157 @@
+#include "llvm/IR/Function.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/CommandLine.h"
+
+#include <llvm/IR/LegacyPassManager.h>
+
+#include <sys/resource.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "Opt.h"
+#include "cfg.h"
+
+using namespace llvm;
+using namespace std;
+
+/*
+    \brief  Функция строит случайный граф из не менее чем n_blocks узлов.
+    \param  [in]  cfg             Граф, в который добавляются узлы
+    \param  [in]  n_blocks        Требуемое число узлов
+    \param  [in]  branch_percent  Вероятность (в процентах), что вставляется
+                                   ветвление, а не один узел
+*/
+void random_graph(ControlFlowGraph& cfg, size_t n_blocks, int branch_percent)
+{
+    while(cfg.nodes.size() < n_blocks)
+        cfg.insert_node(rand() % cfg.nodes.size(), rand() % 100 < branch_percent);
+}
+
+/*
+    \brief  Пиковый объем резидентной памяти процесса в килобайтах.
+*/
+long peak_rss_kb()
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+/*
+    \brief  Функция считает число вставленных последовательностей
+            (вызовов llvm.write_register) в функции.
+*/
+size_t count_inserted(Function& F)
+{
+    size_t n_inserted = 0;
+    for(BasicBlock& BB : F)
+        for(Instruction& I : BB)
+            if(auto II = dyn_cast<IntrinsicInst>(&I))
+                n_inserted += II->getIntrinsicID() == Intrinsic::write_register;
+    return n_inserted;
+}
+
+/*
+    \brief  Имя алгоритма обхода в терминах -reg-inserter-algorithm.
+*/
+const char* algorithm_name(TraversalAlgorithm algorithm)
+{
+    switch(algorithm)
+    {
+        case STACK_IMP:    return "stack";
+        case DFS_IMP:      return "dfs";
+        case INTERVAL_IMP: return "interval";
+    }
+    return "unknown";
+}
+
+/*
+    \brief  Бенчмарк прохода на функциях с большим числом блоков.
+    \note   Использование: bench_pass [n_blocks] [n_callees] [n_runs] [branch_percent] [-json]
+                                     [опции прохода]
+            С -json печатается один JSON-объект с медианой времени по всем
+            запускам, пиковой памятью и числом вставок. Опции прохода, например
+            -reg-inserter-algorithm=interval, передаются в cl::opt.
+*/
+int main(int argc, char** argv)
+{
+    vector<const char*> positional;
+    vector<const char*> options = {argv[0]};
+    bool json = false;
+    for(int i = 1; i < argc; i++)
+    {
+        if(string(argv[i]) == "-json")
+            json = true;
+        else if(argv[i][0] == '-')
+            options.push_back(argv[i]);
+        else
+            positional.push_back(argv[i]);
+    }
+    cl::ParseCommandLineOptions(options.size(), options.data());
+
+    size_t n_blocks       = positional.size() > 0 ? atol(positional[0]) : 100000;
+    size_t n_callees      = positional.size() > 1 ? atol(positional[1]) : 64;
+    int    n_runs         = positional.size() > 2 ? atoi(positional[2]) : 3;
+    int    branch_percent = positional.size() > 3 ? atoi(positional[3]) : 50;
+    srand(1);
+
+    ControlFlowGraph cfg;
+    random_graph(cfg, n_blocks, branch_percent);
+    vector<ControlFlowGraph::Rule> rules;
+    for(size_t i = 0; i < 2 * cfg.nodes.size(); i++)
+        rules.push_back({rand() % cfg.nodes.size(), rand() % n_callees, ControlFlowGraph::DIRECT_CALL});
+
+    vector<double> times;
+    size_t n_inserted = 0;
+    for(int run = 0; run < n_runs; run++)
+    {
+        LLVMContext context;
+        Module* module = new Module("Bench_module", context);
+        Function* mainFunc = cfg.build(module, rules);
+
+        legacy::FunctionPassManager* TheFPM = new legacy::FunctionPassManager(module);
+        TheFPM->add(createRegInserterPass());
+        TheFPM->doInitialization();
+        auto start = chrono::steady_clock::now();
+        TheFPM->run(*mainFunc);
+        auto stop = chrono::steady_clock::now();
+        delete TheFPM;
+
+        double seconds = chrono::duration<double>(stop - start).count();
+        times.push_back(seconds);
+        n_inserted = count_inserted(*mainFunc);
+        if(!json)
+            cout << "blocks "     << cfg.nodes.size()
+                 << " calls "     << rules.size()
+                 << " callees "   << n_callees
+                 << " inserted "  << n_inserted
+                 << " time "      << seconds << " s"
+                 << " blocks/s "  << cfg.nodes.size() / seconds << endl;
+        delete module;
+    }
+
+    if(json && !times.empty())
+    {
+        std::sort(times.begin(), times.end());
+        double median = times[times.size() / 2];
+        cout << "{\"algorithm\": \"" << algorithm_name(RegInserterAlgorithm) << "\""
+             << ", \"blocks\": "         << cfg.nodes.size()
+             << ", \"branch_percent\": " << branch_percent
+             << ", \"callees\": "        << n_callees
+             << ", \"calls\": "          << rules.size()
+             << ", \"inserted\": "       << n_inserted
+             << ", \"runs\": "           << n_runs
+             << ", \"median_s\": "       << median
+             << ", \"min_s\": "          << times.front()
+             << ", \"blocks_per_s\": "   << cfg.nodes.size() / median
+             << ", \"peak_rss_kb\": "    << peak_rss_kb() << "}" << endl;
+    }
+    return 0;
+}
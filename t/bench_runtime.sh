@@ -0,0 +1,89 @@
+#!/bin/bash
+# Runtime harness for the benchmarks, driven by `make bench-runtime`.
+#
+# By default every benchmark is run in three builds:
+#   <bench>.nofixed  reference built without reserving RESERVED_REG
+#   <bench>.ref      reference with RESERVED_REG reserved
+#   <bench>.opt      reserved RESERVED_REG plus the sequences inserted by the pass
+# so that opt vs ref is the cost of the sequences and ref vs nofixed is the
+# cost of reserving the register. VARIANTS may add more builds
+# <bench>.<variant> (e.g. thread-local.opt, global.opt) or replace them; the
+# first variant is the baseline every other build is compared against.
+#
+# For every argument in BENCH_ARGS each build runs BENCH_REPS times and the
+# median, min, max and spread ((max - min) / median) of the wall time are
+# reported. One more run under the TCG plugin INSN_PLUGIN gives the exact
+# number of executed guest instructions. Outputs of all builds must match.
+#
+# Environment: BENCHES, BENCH_ARGS, BENCH_REPS, RESERVED_REG, BENCH_CSV, VARIANTS,
+#              RUN (command prefix, e.g. "qemu-aarch64 -L /usr/aarch64-linux-gnu";
+#              empty: native runs), INSN_PLUGIN (needs qemu in RUN; empty: no
+#              instruction counts).
+
+set -e
+VARIANTS=${VARIANTS:-nofixed ref opt}
+BASE=${VARIANTS%% *}
+REG=${RESERVED_REG:-x28}
+CSV=${BENCH_CSV:-bench_runtime.csv}
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+# prints "median min max" of the samples on stdin
+stats() {
+    sort -g | awk '{ v[NR] = $1 }
+        END { m = NR % 2 ? v[(NR + 1) / 2] : (v[NR / 2] + v[NR / 2 + 1]) / 2;
+              printf "%.4f %.4f %.4f", m, v[1], v[NR] }'
+}
+
+# prints "a / b" or "-" when either side is missing
+ratio() {
+    awk -v a="$1" -v b="$2" 'BEGIN { if (a == "-" || b == "-" || b == 0) print "-"; else printf "%.4f", a / b }'
+}
+
+echo "bench,arg,variant,median_s,min_s,max_s,spread_pct,insns" > "$CSV"
+printf "%-14s %-6s %-18s %10s %10s %10s %8s %14s\n" \
+    bench arg variant median_s min_s max_s spread insns
+for b in $BENCHES; do
+    for a in $BENCH_ARGS; do
+        declare -A median insns
+        for v in $VARIANTS; do
+            : > "$tmp/times"
+            for i in $(seq "$BENCH_REPS"); do
+                start=$(date +%s.%N)
+                $RUN "./$b.$v" "$a" > "$tmp/out.$v"
+                end=$(date +%s.%N)
+                awk -v s="$start" -v e="$end" 'BEGIN { print e - s }' >> "$tmp/times"
+            done
+            if ! cmp -s "$tmp/out.$BASE" "$tmp/out.$v"; then
+                echo "$b $a: output of $b.$v differs from $b.$BASE" >&2
+                exit 1
+            fi
+
+            insns[$v]="-"
+            if [ -n "$INSN_PLUGIN" ]; then
+                $RUN -plugin "$INSN_PLUGIN" -d plugin -D "$tmp/insns" \
+                    "./$b.$v" "$a" > /dev/null
+                insns[$v]=$(awk '$1 == "insns" { print $2 }' "$tmp/insns")
+            fi
+
+            read -r med min max <<< "$(stats < "$tmp/times")"
+            median[$v]=$med
+            spread=$(awk -v m="$med" -v lo="$min" -v hi="$max" 'BEGIN { printf "%.1f", m ? 100 * (hi - lo) / m : 0 }')
+            printf "%-14s %-6s %-18s %10s %10s %10s %7s%% %14s\n" \
+                "$b" "$a" "$v" "$med" "$min" "$max" "$spread" "${insns[$v]}"
+            echo "$b,$a,$v,$med,$min,$max,$spread,${insns[$v]}" >> "$CSV"
+        done
+        if [ "$BASE" = nofixed ] && [ -n "${median[ref]}" ] && [ -n "${median[opt]}" ]; then
+            echo "  reserve $REG (ref/nofixed): time x$(ratio "${median[ref]}" "${median[nofixed]}")," \
+                 "insns x$(ratio "${insns[ref]}" "${insns[nofixed]}")"
+            echo "  sequences   (opt/ref):     time x$(ratio "${median[opt]}" "${median[ref]}")," \
+                 "insns x$(ratio "${insns[opt]}" "${insns[ref]}")"
+        fi
+        for v in $VARIANTS; do
+            case $v in $BASE) continue ;; nofixed|ref|opt) [ "$BASE" = nofixed ] && continue ;; esac
+            echo "  $v (/$BASE): time x$(ratio "${median[$v]}" "${median[$BASE]}")," \
+                 "insns x$(ratio "${insns[$v]}" "${insns[$BASE]}")"
+        done
+        unset median insns
+    done
+done
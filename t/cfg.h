@@ -0,0 +1,303 @@
+#ifndef CFG_H
+#define CFG_H
+
+#include "llvm/IR/BasicBlock.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/MDBuilder.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/Type.h"
+
+#include <array>
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+struct ControlFlowGraph
+{
+
+    /*
+        \brief   Структура, реализующая узел в графе
+        \details У узла не больше двух детей, поэтому их индексы хранятся
+                 прямо в узле, а все узлы лежат подряд в одном векторе:
+                 это CSR-представление с неявными смещениями 2 * i, без
+                 отдельного выделения памяти на узел или на массив детей.
+    */
+    struct Node
+    {
+        uint32_t n_child;        /* число детей у данного узла */
+        uint32_t m_child_ids[2]; /* индексы детей, сами узлы лежат в `nodes` */
+    };
+
+    /* набор всех */
+    std::vector<Node> nodes;
+
+    /*
+        \brief   Веса ветвлений (!prof branch_weights) по индексам узлов
+        \details Хранятся отдельно от узлов, чтобы графы без профиля не
+                 платили за них памятью. Узлы за концом вектора и узлы с
+                 нулевыми весами обоих детей строятся без !prof.
+    */
+    std::vector<std::array<uint32_t, 2>> weights;
+
+    /* function_entry_count строящейся функции, 0 - без счетчика */
+    uint64_t entry_count = 0;
+
+    using FunctionId_t = size_t;
+
+    /*
+        \brief Вид вызова, который правило вставляет в блок
+    */
+    enum CallKind
+    {
+        DIRECT_CALL,   /* call @function_N */
+        BITCAST_CALL,  /* call через bitcast @function_N */
+        INDIRECT_CALL, /* call через указатель, загруженный в entry */
+        INVOKE,        /* invoke @function_N, блок продолжается в новом блоке */
+        N_CALL_KINDS
+    };
+
+    /*
+        \brief Правило: вставить в узел node вызов функции function
+    */
+    struct Rule
+    {
+        size_t       node;
+        FunctionId_t function;
+        CallKind     kind;
+    };
+    
+    ControlFlowGraph()
+    {
+        nodes.push_back({1, {1, 0}}); // entry -> last
+        nodes.push_back({0, {0, 0}}); // last
+    }
+
+    /*
+        \brief  Резервирует память под граф из n_nodes узлов.
+    */
+    void reserve(size_t n_nodes)
+    {
+        nodes.reserve(n_nodes);
+    }
+
+    /*
+        \brief  Функция реализует добавление в граф нового
+                узла.
+        \param  [in]  index     Индекс узла, после которго следует
+                                создать новый узел.
+        \param  [in]  isBranch  Флаг, указывающий на то будет добавлен
+                                один узел или два.
+    */
+    void insert_node(size_t index, bool isBranch)
+    {
+        if(nodes.size() <= index)
+            return;
+
+        /* новые узлы наследуют детей узла index, а он переходит на них */
+        Node parent = nodes[index];
+        uint32_t first = nodes.size();
+        nodes.push_back(parent);
+        if(isBranch)
+            nodes.push_back(parent);
+        nodes[index] = {isBranch ? 2u : 1u, {first, isBranch ? first + 1 : 0}};
+    }
+
+    /*
+        \brief   Функция добавляет в граф цикл с заголовком index.
+        \details Узел index переходит в новый узел-защелку, защелка - обратно
+                 в index и в новый узел выхода, который наследует детей
+                 index. Все пути в защелку проходят через index, поэтому
+                 обратное ребро ведет в доминирующий блок, а следующие
+                 вставки лишь удлиняют или вкладывают циклы.
+        \param   [in]  index  Индекс узла - заголовка цикла.
+    */
+    void insert_loop(size_t index)
+    {
+        if(nodes.size() <= index)
+            return;
+
+        Node parent = nodes[index];
+        uint32_t latch = nodes.size();
+        nodes.push_back({2, {uint32_t(index), latch + 1}});
+        nodes.push_back(parent);
+        nodes[index] = {1, {latch, 0}};
+    }
+
+    /*
+        \brief  Задает веса переходов узла с двумя детьми.
+        \param  [in]  index  Индекс узла
+        \param  [in]  first  Вес перехода в первого ребенка
+        \param  [in]  second Вес перехода во второго ребенка
+    */
+    void set_weights(size_t index, uint32_t first, uint32_t second)
+    {
+        if(nodes.size() <= index)
+            return;
+
+        if(weights.size() <= index)
+            weights.resize(index + 1, {0, 0});
+        weights[index] = {first, second};
+    }
+
+    /*
+        \brief  Функция генерирует dot файл, на основе построенного графа.
+        \note   Dot-файл имеет название `CFG.dot`
+    */
+    void draw()
+    {
+        std::fstream file;
+        file.open("CFG.dot", std::fstream::out);
+        file << "digraph G{\n";
+        file << "node [shape = rectangle]\n";
+        for(size_t i = 0; i < nodes.size(); i++)
+            for(size_t j = 0; j < nodes[i].n_child; j++)
+                file << "NODE" << i << "->" << "NODE" << nodes[i].m_child_ids[j] << ";" << std::endl;
+        file << "}\n";
+        file.close();
+    }
+
+    /*
+        \brief   Функция строит IR по графу.
+        \details В модуле создается функция `main`, базовые блоки которой
+                 соответствуют узлам графа. В блоки вставляются вызовы
+                 внешних функций `function_N` согласно правилам: прямые,
+                 через bitcast, через указатель на функцию и invoke.
+                 Ветвления получают веса из `weights`, функция - счетчик
+                 входов `entry_count`.
+        \param   [in]  module  Модуль, в котором создается функция
+        \param   [in]  rules   Массив правил, по которым в граф вставляются функции
+        \param   [in]  name    Имя создаваемой функции
+        \return  Построенная функция.
+    */
+    llvm::Function* build(llvm::Module* module, const std::vector<Rule>& rules,
+                          const std::string& name = "main")
+    {
+        using namespace llvm;
+        using std::to_string;
+        LLVMContext& context = module->getContext();
+        IRBuilder<> builder(context);
+
+        /*define i32 main(i32 %0)*/
+        FunctionType* funcType = FunctionType::get(builder.getInt32Ty(), {builder.getInt32Ty()}, false);
+        Function*     mainFunc = Function::Create(funcType, Function::ExternalLinkage, name, module);
+        if(entry_count)
+            mainFunc->setEntryCount(Function::ProfileCount(entry_count, Function::PCT_Real));
+        BasicBlock*   entryBB  = BasicBlock::Create(context, "entry", mainFunc);
+        builder.SetInsertPoint(entryBB);
+
+        /* all branches will use `argc` from function `main` as condition */
+        Value* condition = builder.CreateICmpNE(mainFunc->getArg(0), builder.getInt32(0));
+
+        /* prepare basic blocks */
+        std::vector<BasicBlock*> bb(nodes.size());
+        for(size_t i = 0; i < nodes.size(); i++)
+            bb[i] = BasicBlock::Create(context, "BB" + to_string(i), mainFunc);
+        /* блок, в котором заканчивается узел (после invoke он продолжается в новом) */
+        std::vector<BasicBlock*> tail = bb;
+
+        /* jumping from entry to first bb in graph */
+        Instruction* entryBr = builder.CreateBr(bb[0]);
+
+        /* insert functions in blocks */
+        FunctionType* externalFunctionType = FunctionType::get(builder.getInt32Ty(), false);
+        FunctionType* castedFunctionType   = FunctionType::get(builder.getVoidTy(), false);
+        std::vector<FunctionCallee> callees;
+        std::vector<Value*> pointers;
+        BasicBlock* landingPad = nullptr;
+        for(const auto& rule : rules)
+        {
+            builder.SetInsertPoint(tail[rule.node]);
+            /* объявления функций ищутся по имени один раз на функцию, а не на правило */
+            if(callees.size() <= rule.function)
+                callees.resize(rule.function + 1);
+            if(!callees[rule.function])
+                callees[rule.function] = module->getOrInsertFunction(
+                    "function_" + to_string(rule.function),
+                    externalFunctionType
+                );
+            FunctionCallee f = callees[rule.function];
+            switch(rule.kind)
+            {
+                case BITCAST_CALL:
+                    builder.CreateCall(castedFunctionType,
+                        ConstantExpr::getBitCast(cast<Constant>(f.getCallee()), castedFunctionType->getPointerTo()));
+                    break;
+                case INDIRECT_CALL:
+                {
+                    /* указатель на функцию загружается один раз в entry */
+                    if(pointers.size() <= rule.function)
+                        pointers.resize(rule.function + 1);
+                    if(!pointers[rule.function])
+                    {
+                        IRBuilder<> entryBuilder(entryBr);
+                        Constant* slot = module->getOrInsertGlobal(
+                            "pointer_" + to_string(rule.function), f.getCallee()->getType());
+                        pointers[rule.function] = entryBuilder.CreateLoad(f.getCallee()->getType(), slot, true);
+                    }
+                    builder.CreateCall(externalFunctionType, pointers[rule.function]);
+                    break;
+                }
+                case INVOKE:
+                {
+                    if(!landingPad)
+                    {
+                        mainFunc->setPersonalityFn(cast<Constant>(module->getOrInsertFunction(
+                            "__gxx_personality_v0", FunctionType::get(builder.getInt32Ty(), true)).getCallee()));
+                        landingPad = BasicBlock::Create(context, "lpad", mainFunc);
+                        IRBuilder<> padBuilder(landingPad);
+                        LandingPadInst* pad = padBuilder.CreateLandingPad(
+                            StructType::get(builder.getInt8PtrTy(), builder.getInt32Ty()), 0);
+                        pad->setCleanup(true);
+                        padBuilder.CreateResume(pad);
+                    }
+                    BasicBlock* cont = BasicBlock::Create(context, tail[rule.node]->getName() + ".cont", mainFunc);
+                    builder.CreateInvoke(f, cont, landingPad);
+                    tail[rule.node] = cont;
+                    break;
+                }
+                default:
+                    builder.CreateCall(f);
+                    break;
+            }
+        }
+
+        /* insert branches in bb */
+        MDBuilder mdBuilder(context);
+        for(size_t i = 0; i < nodes.size(); i++)
+        {
+            builder.SetInsertPoint(tail[i]);
+            switch(nodes[i].n_child)
+            {
+                case 2:
+                {
+                    MDNode* prof = nullptr;
+                    if(i < weights.size() && (weights[i][0] || weights[i][1]))
+                        prof = mdBuilder.createBranchWeights(weights[i][0], weights[i][1]);
+                    builder.CreateCondBr(
+                        condition,
+                        bb[nodes[i].m_child_ids[0]],
+                        bb[nodes[i].m_child_ids[1]],
+                        prof
+                    );
+                    break;
+                }
+                case 1:
+                    builder.CreateBr(bb[nodes[i].m_child_ids[0]]);
+                    break;
+                case 0:
+                    builder.CreateRet(builder.getInt32(0));
+                    break;
+            }
+        }
+
+        return mainFunc;
+    }
+
+    /* проверка прохода на графе, определена в тестере (ir_generator.cpp) */
+    bool evaluate(const std::vector<Rule>& rules, llvm::LLVMContext& context, bool dump = false);
+};
+
+#endif // CFG_H
@@ -0,0 +1,122 @@
+; Размещение последовательностей по частотам (-reg-inserter-frequency-placement)
+; по данным профиля: function_entry_count и branch_weights дают точные счетчики
+; блоков. Проверяются оба исхода динамического программирования по дереву
+; доминаторов: подъем в развилку, когда она дешевле вызовов в поддеревьях, и
+; последовательности в холодных листьях, когда развилка горячее их. Запуск:
+; make check-ir.
+;
+; RUN: %opt -reg-inserter-frequency-placement -S %s | FileCheck %s
+; RUN: %opt -reg-inserter-frequency-placement -reg-inserter-report -disable-output %s 2>&1 \
+; RUN:     | FileCheck --check-prefix=REPORT %s
+
+target triple = "aarch64-unknown-linux-gnu"
+
+declare void @g()
+
+; цикл в одной ветви исполняется ~5000 раз, вызов в другой - 500: одна
+; последовательность в entry (1000) вместо двух у вызовов
+; CHECK-LABEL: define void @hoist_to_fork(
+; CHECK:       entry:
+; CHECK:         call void @llvm.write_register.i64({{.*}}), !reg_inserter.callee
+; CHECK-NEXT:    br i1 %c
+; CHECK:       loop:
+; CHECK-NOT:     @llvm.write_register
+; CHECK:         call void @g()
+; CHECK:       right:
+; CHECK-NOT:     @llvm.write_register
+; CHECK:         call void @g()
+; REPORT: reg_inserter: hoist_to_fork: estimated cost before {{[0-9]+}}, after 1000
+define void @hoist_to_fork(i1 %c, i32 %n) !prof !0 {
+entry:
+  br i1 %c, label %loop, label %right, !prof !1
+
+loop:
+  %i = phi i32 [ 0, %entry ], [ %i.next, %loop ]
+  call void @g()
+  %i.next = add i32 %i, 1
+  %done = icmp eq i32 %i.next, %n
+  br i1 %done, label %exit, label %loop, !prof !2
+
+right:
+  call void @g()
+  br label %exit
+
+exit:
+  ret void
+}
+
+; вызовы в редких ветвях switch (по 10 из 1000): развилка горячее листьев,
+; последовательности остаются у вызовов
+; CHECK-LABEL: define void @cold_leaves(
+; CHECK:       entry:
+; CHECK-NOT:     @llvm.write_register
+; CHECK:         switch i32 %k
+; CHECK:       a:
+; CHECK:         call void @llvm.write_register.i64({{.*}}), !reg_inserter.callee
+; CHECK-NEXT:    call void @g()
+; CHECK:       b:
+; CHECK:         call void @llvm.write_register.i64({{.*}}), !reg_inserter.callee
+; CHECK-NEXT:    call void @g()
+; REPORT: reg_inserter: cold_leaves: estimated cost before 20, after 20
+define void @cold_leaves(i32 %k) !prof !0 {
+entry:
+  switch i32 %k, label %common [
+    i32 0, label %a
+    i32 1, label %b
+  ], !prof !3
+
+a:
+  call void @g()
+  br label %exit
+
+b:
+  call void @g()
+  br label %exit
+
+common:
+  br label %exit
+
+exit:
+  ret void
+}
+
+; обе ветви холодной развилки вызывают @g: последовательность поднимается
+; в развилку rare (10), но не в горячий entry (1000)
+; CHECK-LABEL: define void @cold_fork(
+; CHECK:       entry:
+; CHECK-NOT:     @llvm.write_register
+; CHECK:         br i1 %c
+; CHECK:       rare:
+; CHECK:         call void @llvm.write_register.i64({{.*}}), !reg_inserter.callee
+; CHECK-NEXT:    br i1 %d
+; CHECK:       a:
+; CHECK-NOT:     @llvm.write_register
+; CHECK:         call void @g()
+; CHECK:       b:
+; CHECK-NOT:     @llvm.write_register
+; CHECK:         call void @g()
+; REPORT: reg_inserter: cold_fork: estimated cost before 10, after 10
+define void @cold_fork(i1 %c, i1 %d) !prof !0 {
+entry:
+  br i1 %c, label %rare, label %exit, !prof !4
+
+rare:
+  br i1 %d, label %a, label %b, !prof !1
+
+a:
+  call void @g()
+  br label %exit
+
+b:
+  call void @g()
+  br label %exit
+
+exit:
+  ret void
+}
+
+!0 = !{!"function_entry_count", i64 1000}
+!1 = !{!"branch_weights", i32 1, i32 1}
+!2 = !{!"branch_weights", i32 1, i32 9}
+!3 = !{!"branch_weights", i32 980, i32 10, i32 10}
+!4 = !{!"branch_weights", i32 1, i32 99}
@@ -0,0 +1,61 @@
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "cfg.h"
+
+using namespace llvm;
+using namespace std;
+
+/*
+    \brief  Генератор большого модуля для замеров драйвера reg_inserter_driver.
+    \note   Использование: gen_module.out [n_functions] [n_blocks] [output.bc] [direct]
+            Модуль состоит из функции `main` и функций `f_N`, каждая построена
+            по своему случайному графу из n_blocks узлов. С `direct` все
+            вызовы прямые (такой модуль понимает исходная версия прохода,
+            см. compile-time в Makefile), граф и функции вызовов те же.
+*/
+int main(int argc, char** argv)
+{
+    size_t n_functions = argc > 1 ? atol(argv[1]) : 20000;
+    size_t n_blocks    = argc > 2 ? atol(argv[2]) : 64;
+    string output      = argc > 3 ? argv[3] : "big.bc";
+    bool   direct      = argc > 4 && string(argv[4]) == "direct";
+    srand(1);
+
+    LLVMContext context;
+    Module* module = new Module("Big_module", context);
+    for(size_t i = 0; i < n_functions; i++)
+    {
+        ControlFlowGraph cfg;
+        while(cfg.nodes.size() < n_blocks)
+            cfg.insert_node(rand() % cfg.nodes.size(), rand() & 1);
+        vector<ControlFlowGraph::Rule> rules;
+        for(size_t j = 0; j < 2 * cfg.nodes.size(); j++)
+        {
+            size_t node     = rand() % cfg.nodes.size();
+            size_t function = rand() % cfg.nodes.size();
+            auto   kind     = ControlFlowGraph::CallKind(rand() % ControlFlowGraph::N_CALL_KINDS);
+            rules.push_back({node, function, direct ? ControlFlowGraph::DIRECT_CALL : kind});
+        }
+        cfg.build(module, rules, i ? "f_" + to_string(i) : "main");
+    }
+
+    error_code EC;
+    raw_fd_ostream os(output, EC, sys::fs::OF_None);
+    if(EC)
+    {
+        cerr << output << ": " << EC.message() << endl;
+        return 1;
+    }
+    WriteBitcodeToFile(*module, os);
+    delete module;
+    return 0;
+}
@@ -0,0 +1,39 @@
+/*
+    \brief   TCG-плагин qemu, считающий число выполненных гостевых инструкций.
+    \details Для каждого транслируемого блока регистрируется inline-счетчик,
+             увеличивающийся на число инструкций блока при каждом его
+             выполнении, поэтому результат точный и не зависит от нагрузки
+             на машину. Итог печатается при выходе строкой `insns N`
+             (при запуске с `-d plugin -D file` - в файл).
+    \note    Счетчик общий для всех vcpu и не атомарный: для
+             многопоточных программ значение приблизительное.
+*/
+#include <inttypes.h>
+#include <stdio.h>
+
+#include <qemu-plugin.h>
+
+QEMU_PLUGIN_EXPORT int qemu_plugin_version = QEMU_PLUGIN_VERSION;
+
+static uint64_t insn_count;
+
+static void tb_trans(qemu_plugin_id_t id, struct qemu_plugin_tb* tb)
+{
+    qemu_plugin_register_vcpu_tb_exec_inline(tb, QEMU_PLUGIN_INLINE_ADD_U64,
+                                             &insn_count, qemu_plugin_tb_n_insns(tb));
+}
+
+static void plugin_exit(qemu_plugin_id_t id, void* p)
+{
+    char buffer[64];
+    snprintf(buffer, sizeof(buffer), "insns %" PRIu64 "\n", insn_count);
+    qemu_plugin_outs(buffer);
+}
+
+QEMU_PLUGIN_EXPORT int qemu_plugin_install(qemu_plugin_id_t id, const qemu_info_t* info,
+                                           int argc, char** argv)
+{
+    qemu_plugin_register_vcpu_tb_trans_cb(id, tb_trans);
+    qemu_plugin_register_atexit_cb(id, plugin_exit, NULL);
+    return 0;
+}
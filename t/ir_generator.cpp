@@ -4,9 +4,11 @@
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/Type.h"
+#include "llvm/IR/Verifier.h"
 #include "llvm/ExecutionEngine/ExecutionEngine.h"
 #include "llvm/ExecutionEngine/GenericValue.h"
 #include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/CommandLine.h"
 
 #include <llvm/IR/LegacyPassManager.h>
 #include <llvm/Transforms/Scalar.h>
@@ -15,40 +17,23 @@
 #include "llvm/ADT/GraphTraits.h"
 #include "llvm/Support/GenericDomTree.h"
 
+#include <atomic>
+#include <chrono>
+#include <cstdio>
 #include <iostream>
 #include <fstream>
+#include <mutex>
+#include <random>
 #include <string>
+#include <thread>
 #include <vector>
-#include <stack>
 
 #include "Opt.h"
+#include "cfg.h"
 
 using namespace llvm;
 using namespace std;
 
-/*
-    \brief   Аллокатор для построения графа
-    \details Аллокатор для построения графа,
-             используется для выделения памяти
-             под массивы индексов детей.
-*/
-struct Allocator
-{
-    size_t* allocate(int n)
-    {
-        size_t* ptr = new size_t[n];
-        m_memory.push_back({ptr,n});
-        return ptr;
-    }
-    void clean_up()
-    {
-        for(auto it : m_memory)
-            delete[] it.first;
-        m_memory.clear();
-    }
-    private:
-    std::vector<std::pair<size_t*, int>> m_memory;
-};
 
 /*
     \brief   Валидатор сгенерированного IR
@@ -67,273 +52,336 @@ struct Validator
                 время проверки IR.
     */
     private:
-    std::set<size_t> declarated_functions;
+    DenseSet<const Value*> declarated_functions;
 
-    
     /*
-        \brief   Функция рекурсивно проверяет IR.
-        \details Функция рекурсивно проверяет, что для
-                 каждой функции был сгенерирован код с
-                 обращением к регистру.
-        \param   [in]  node  Указатель на корень дерева доминаторов
-        \return  В случае нахождения ошибок в построении IR возвращается
-                 true.
+        \brief  Журнал объявленных функций: при выходе из узла
+                дерева доминаторов откатываются записи его поддерева.
     */
-    public:
-    bool verify(DomTreeNode* node)
+    std::vector<const Value*> saved_functions;
+
+    /*
+        \brief  Запись цепочки, объявившая функцию; значение актуально,
+                пока функция объявлена.
+    */
+    DenseMap<const Value*, const Instruction*> declared_by;
+
+    /*
+        \brief  Записи цепочки с метаданными reg_inserter.callee и те из
+                них, которым засчитан хотя бы один вызов.
+    */
+    std::vector<const Instruction*> tagged_writes;
+    DenseSet<const Instruction*> credited_writes;
+
+    void declare(const Value* callee, const Instruction* write)
+    {
+        if(declarated_functions.insert(callee).second)
+        {
+            saved_functions.push_back(callee);
+            declared_by[callee] = write;
+        }
+    }
+
+    /*
+        \brief  Является ли инструкция записью цепочки: llvm.write_register
+                или store в переменную цепочки (-reg-inserter-lowering).
+    */
+    static bool is_chain_write(const Instruction& I)
     {
-        std::stack<size_t> saved_functions;
-        BasicBlock& BB = *node->getBlock();
+        if(auto II = dyn_cast<IntrinsicInst>(&I))
+            return II->getIntrinsicID() == Intrinsic::write_register;
+        auto SI = dyn_cast<StoreInst>(&I);
+        return SI && SI->getPointerOperand()->getName() == reg_inserter_chain;
+    }
 
+    /*
+        \brief   Проверяет один базовый блок.
+        \details Вызов засчитывается записи цепочки, объявившей его функцию.
+                 Функция вынесенной последовательности известна только по
+                 метаданным прохода, поэтому им не доверяем: запись должна
+                 доминировать над каждым засчитанным ей вызовом (по DT, а
+                 не по обходу), а запись, которой не засчитан ни один
+                 вызов, считается ошибкой в verify.
+        \return  В случае нахождения ошибок возвращается true.
+    */
+    bool verify_block(BasicBlock& BB, const DominatorTree& DT)
+    {
         bool found_undeclarated_function = false;
         bool was_writing_in_register = false;
+        const Instruction* last_write = nullptr;
+        /* в режиме -reg-inserter-coalesce запись в регистр покрывает
+           все следующие вызовы блока до первой записи в память */
+        bool group_open = false;
         for (Instruction& I : BB)
         {
-            if(I.getOpcode() != Instruction::Call)
+            if(is_chain_write(I))
+            {
+                was_writing_in_register = true;
+                group_open |= RegInserterCoalesce;
+                last_write = &I;
+                /* последовательность объявляет первую функцию из своих
+                   метаданных: для вынесенной из места вызова это
+                   единственный способ узнать функцию */
+                if(MDNode* callee_md = I.getMetadata(reg_inserter_callee_md))
+                {
+                    tagged_writes.push_back(&I);
+                    if(auto callee = dyn_cast<ValueAsMetadata>(callee_md->getOperand(0)))
+                        declare(callee->getValue(), &I);
+                }
+                continue;
+            }
+            auto CB = dyn_cast<CallBase>(&I);
+            if(!CB)
             {
                 was_writing_in_register = false;
+                group_open &= !I.mayWriteToMemory();
                 continue;
             }
-            auto CI = cast<CallInst>(&I);
-            if (CI->getCalledFunction()->isIntrinsic())
+            /* вызовы через bitcast относятся к самой функции,
+               косвенные - к значению указателя */
+            Value* callee = CB->getCalledOperand()->stripPointerCasts();
+            auto callee_fn = dyn_cast<Function>(callee);
+            if (callee_fn && callee_fn->isIntrinsic())
             {
-                was_writing_in_register = CI->getCalledFunction()->getIntrinsicID() == Intrinsic::write_register;
+                was_writing_in_register = false;
                 continue;
             }
 
-            size_t func_id = reinterpret_cast<size_t>(CI->getCalledFunction());
-
-            if(was_writing_in_register)
+            if(declarated_functions.count(callee))
             {
-                declarated_functions.insert(func_id);
-                saved_functions.push(func_id);
-                was_writing_in_register = false;
+                const Instruction* write = declared_by.lookup(callee);
+                if(write)
+                {
+                    credited_writes.insert(write);
+                    found_undeclarated_function |= !DT.dominates(write, CB);
+                }
+            }
+            else if(was_writing_in_register || group_open)
+            {
+                /* откатывать можно только объявленное в этом блоке */
+                declare(callee, last_write);
+                credited_writes.insert(last_write);
             }
             else
-                found_undeclarated_function |= !declarated_functions.count(func_id);
+                found_undeclarated_function = true;
+            was_writing_in_register = false;
         }
+        return found_undeclarated_function;
+    }
 
-        for(auto& child : node->children())
-            found_undeclarated_function |= verify(child);
+    /*
+        \brief   Функция проверяет IR.
+        \details Функция обходит дерево доминаторов в глубину с явным
+                 стеком (глубина дерева может достигать числа блоков) и
+                 проверяет, что для каждой функции был сгенерирован код с
+                 обращением к регистру.
+        \param   [in]  DT  Дерево доминаторов проверяемой функции
+        \return  В случае нахождения ошибок в построении IR возвращается
+                 true.
+    */
+    public:
+    bool verify(DominatorTree& DT)
+    {
+        DomTreeNode* root = DT.getRootNode();
+        tagged_writes.clear();
+        credited_writes.clear();
+        /* узел, индекс следующего ребенка и размер журнала при входе в узел */
+        struct Frame
+        {
+            DomTreeNode* node;
+            unsigned     next_child;
+            size_t       mark;
+        };
+        std::vector<Frame> stack;
+        bool found_undeclarated_function = false;
 
-        while(!saved_functions.empty())
+        stack.push_back({root, 0, saved_functions.size()});
+        found_undeclarated_function |= verify_block(*root->getBlock(), DT);
+        while(!stack.empty())
         {
-            declarated_functions.erase(saved_functions.top());
-            saved_functions.pop();
+            Frame& frame = stack.back();
+            if(frame.next_child < frame.node->getNumChildren())
+            {
+                DomTreeNode* child = *(frame.node->begin() + frame.next_child++);
+                stack.push_back({child, 0, saved_functions.size()});
+                found_undeclarated_function |= verify_block(*child->getBlock(), DT);
+                continue;
+            }
+            while(saved_functions.size() > frame.mark)
+            {
+                declarated_functions.erase(saved_functions.back());
+                saved_functions.pop_back();
+            }
+            stack.pop_back();
         }
 
+        for(const Instruction* write : tagged_writes)
+            found_undeclarated_function |= !credited_writes.count(write);
         return found_undeclarated_function;
     }
+
+    /*
+        \brief   Проверяет, что повторные запуски прохода ничего не меняют.
+        \details Второй запуск пропускает функцию по атрибуту
+                 reg_inserter.instrumented; без атрибута он должен
+                 узнать уже вставленные последовательности и пролог и
+                 получить тот же IR.
+        \return  В случае расхождения возвращается true.
+    */
+    bool verify_rerun(Module* module, Function* func);
 };
 
 
-Allocator node_allocator;
+/*
+    \brief  Запускает проход (по умолчанию RegInserter) над функцией модуля.
+*/
+static void run_reg_inserter(Module* module, Function* func, FunctionPass* pass = createRegInserterPass())
+{
+    legacy::FunctionPassManager* TheFPM = new legacy::FunctionPassManager(module);
+    TheFPM->add(pass);
+    TheFPM->doInitialization();
+    TheFPM->run(*func);
+    delete TheFPM;
+}
 
 
-struct ControlFlowGraph
+static std::string print_module(const Module* module)
 {
+    std::string s;
+    raw_string_ostream os(s);
+    module->print(os, nullptr);
+    return os.str();
+}
 
-    /*
-        \brief Структура, реализующая узел в графе
-    */
-    struct Node
-    {
-        int n_child;         /* число детей у данного узла */
-        size_t* m_child_ids; /* массив с индексами детей, сами узлы лежат в `nodes` */
-        Node(int nChilds, size_t* childs = nullptr) :
-            n_child(nChilds),
-            m_child_ids(childs)
-        {
-            if(n_child && !childs)
-                m_child_ids = node_allocator.allocate(n_child);
-        }
-        ~Node(){}
-    };
 
-    /* набор всех */
-    vector<Node*> nodes;
+bool Validator::verify_rerun(Module* module, Function* func)
+{
+    std::string first = print_module(module);
+    run_reg_inserter(module, func);
+    if(print_module(module) != first)
+        return true;
+    func->removeFnAttr(reg_inserter_instrumented);
+    run_reg_inserter(module, func);
+    return print_module(module) != first;
+}
 
-    using FunctionId_t = size_t;
-    
-    ControlFlowGraph()
-    {
-        nodes.reserve(2);
-        nodes.resize(2);
-        nodes[0] = new Node(1);       // entry
-        nodes[1] = new Node(0);       // last
-        nodes[0]->m_child_ids[0] = 1; // entry -> last
-    }
 
-    ~ControlFlowGraph()
-    {
-        node_allocator.clean_up();
-        for(auto& node : nodes)
-            delete node;
-    }
+/*
+    \brief   Функция тестирует оптимизационный проход.
+    \details По передаваемым в функцию правилами строится IR предстваление,
+             над которым выполняется оптимизационный проход. После чего,
+             полученный IR проверяется верификатором LLVM (с
+             -reg-inserter-counters в нем есть счетчики и записи мест) и
+             на корректность валидатором, а
+             повторные запуски прохода не должны его менять.
+             С -reg-inserter-cache-dir проход запускается еще раз над
+             копией того же графа: результат, восстановленный из кэша,
+             должен совпасть с результатом обхода. Затем проверяется
+             reg_inserter_cleanup: сразу после прохода он ничего не удаляет,
+             после SimplifyCFG не портит корректный IR и идемпотентен.
+    \param   [in]  rules    Массив правил, по которым в граф вставляются функции
+    \param   [in]  context  Контекст потока, в котором создается модуль
+    \param   [in]  dump     Записать IR после прохода в файл `t.ll`
+*/
+bool ControlFlowGraph::evaluate(const std::vector<Rule>& rules, LLVMContext& context, bool dump)
+{
+    Module* module = new Module("Main_module", context);
+    Function* mainFunc = build(module, rules);
 
-    /*
-        \brief  Функция реализует добавление в граф нового
-                узла.
-        \param  [in]  index     Индекс узла, после которго следует
-                                создать новый узел.
-        \param  [in]  isBranch  Флаг, указывающий на то будет добавлен
-                                один узел или два.
-    */
-    void insert_node(int index, bool isBranch)
-    {
-        if(index < 0 || nodes.size() <= index)
-            return;
-        
-        int nChilds = nodes[index]->n_child; 
+    /* do our optimization */
+    run_reg_inserter(module, mainFunc);
 
-        if(isBranch)
-        {
-            Node* brnch_true  = new Node(nChilds, nodes[index]->m_child_ids);
-            Node* brnch_false = new Node(nChilds, nodes[index]->m_child_ids);
-            nodes.push_back(brnch_true);
-            nodes.push_back(brnch_false);
-            nodes[index]->m_child_ids = node_allocator.allocate(2);
-            nodes[index]->m_child_ids[0] = nodes.size() - 2;
-            nodes[index]->m_child_ids[1] = nodes.size() - 1;
-            nodes[index]->n_child = 2;
-        }
-        else
-        {
-            Node* new_node  = new Node(nChilds, nodes[index]->m_child_ids);
-            nodes.push_back(new_node);
-            nodes[index]->m_child_ids = node_allocator.allocate(1);
-            nodes[index]->m_child_ids[0] = nodes.size() - 1;
-            nodes[index]->n_child = 1;
-        }
-    }
+    /* check validity of reg insreter */
+    bool is_error_occur = verifyModule(*module, &errs());
+    Validator validator;
+    DominatorTree* dTree = new DominatorTree(*mainFunc);
+    is_error_occur |= validator.verify(*dTree);
+    delete dTree;
+    is_error_occur |= validator.verify_rerun(module, mainFunc);
 
-    /*
-        \brief  Функция генерирует dot файл, на основе построенного графа.
-        \note   Dot-файл имеет название `CFG.dot`
-    */
-    void draw()
+    if(!RegInserterCacheDir.empty())
     {
-        fstream file;
-        file.open("CFG.dot", fstream::out);
-        file << "digraph G{\n";
-        file << "node [shape = rectangle]\n";
-        for(size_t i = 0; i < nodes.size(); i++)
-            for(size_t j = 0; j < nodes[i]->n_child; j++)
-                file << "NODE" << i << "->" << "NODE" << nodes[i]->m_child_ids[j] << ";" << std::endl;
-        file << "}\n";
-        file.close();
+        Module* cached = new Module("Main_module", context);
+        run_reg_inserter(cached, build(cached, rules));
+        is_error_occur |= print_module(cached) != print_module(module);
+        delete cached;
     }
 
-    /*
-        \brief   Функция тестирует оптимизационный проход.
-        \details По передаваемым в функцию правилами строится IR предстваление,
-                 над которым выполняется оптимизационный проход. После чего,
-                 полученный IR проверяется на корректность валидатором.
-        \param   [in]  rules  Массив правил, по которым в граф вставляются функции
-    */
-    bool evaluate(const std::vector<std::pair<size_t, FunctionId_t>>& rules)
+    /* все вставленные последовательности нужны */
+    std::string inserted = print_module(module);
+    run_reg_inserter(module, mainFunc, createRegInserterCleanupPass());
+    is_error_occur |= print_module(module) != inserted;
+
+    /* слияние блоков делает часть последовательностей лишними; сам
+       SimplifyCFG может менять доминирование и нарушать проверку, но
+       если IR после него корректен, чистка не должна это испортить,
+       а повторная чистка - ничего менять */
+    run_reg_inserter(module, mainFunc, createCFGSimplificationPass());
+    dTree = new DominatorTree(*mainFunc);
+    bool simplified_valid = !validator.verify(*dTree);
+    delete dTree;
+    run_reg_inserter(module, mainFunc, createRegInserterCleanupPass());
+    dTree = new DominatorTree(*mainFunc);
+    is_error_occur |= simplified_valid && validator.verify(*dTree);
+    delete dTree;
+    std::string cleaned = print_module(module);
+    run_reg_inserter(module, mainFunc, createRegInserterCleanupPass());
+    is_error_occur |= print_module(module) != cleaned;
+
+    if(dump)
     {
-        LLVMContext context;
-        IRBuilder<> builder(context);
-        Module* module = new Module("Main_module", context);
-
-        /*define i32 main(i32 %0)*/
-        FunctionType* funcType = FunctionType::get(builder.getInt32Ty(), {builder.getInt32Ty()}, false);
-        Function*     mainFunc = Function::Create(funcType, Function::ExternalLinkage, "main", module);
-        BasicBlock*   entryBB  = BasicBlock::Create(context, "entry", mainFunc);
-        builder.SetInsertPoint(entryBB);
-
-        /* all branches will use `argc` from function `main` as condition */
-        Value* condition = mainFunc->getArg(0);
-
-        /* prepare basic blocks */
-        std::vector<BasicBlock*> bb(nodes.size());
-        for(int i = 0; i < nodes.size(); i++)
-            bb[i] = BasicBlock::Create(context, "BB" + to_string(i), mainFunc);
+        fstream ir_file;
+        ir_file.open("t.ll", std::fstream::out);
+        ir_file << print_module(module) << std::endl;
+        ir_file.close();
+    }
 
-        /* jumping from entry to first bb in graph */
-        builder.CreateBr(bb[0]);
+    delete module;
 
-        /* insert functions in blocks */
-        FunctionType* externalFunctionType = FunctionType::get(builder.getInt32Ty(), false);
-        for(const auto& rule : rules)
-        {
-            builder.SetInsertPoint(bb[rule.first]);
-            FunctionCallee f = module->getOrInsertFunction(
-                "function_" + to_string(rule.second),
-                externalFunctionType
-            );
-            builder.CreateCall(f);
-        }
+    return is_error_occur;
+}
 
-        /* insert branches in bb */
-        for(int i = 0; i < nodes.size(); i++)
-        {
-            builder.SetInsertPoint(bb[i]);
-            switch(nodes[i]->n_child)
-            {
-                case 2:
-                    builder.CreateCondBr(
-                        condition,
-                        bb[nodes[i]->m_child_ids[0]],
-                        bb[nodes[i]->m_child_ids[1]]
-                    );
-                    break;
-                case 1:
-                    builder.CreateBr(bb[nodes[i]->m_child_ids[0]]);
-                    break;
-                case 0:
-                    builder.CreateRet(builder.getInt32(0));
-                    break;
-            }
-        }
 
-        /* do our optimization */
-        legacy::FunctionPassManager* TheFPM = new legacy::FunctionPassManager(module);
-        TheFPM->add(createRegInserterPass());
-        TheFPM->doInitialization();
-        TheFPM->run(*mainFunc);
-        delete TheFPM;
-
-        /* check validity of reg insreter */
-        Validator validator;
-        DominatorTree* dTree = new DominatorTree(*mainFunc);
-        bool is_error_occur = validator.verify(dTree->getRootNode());
-        delete dTree;
-
-        /*
-        std::string s;
-        raw_string_ostream os(s);
-        module->print(os, nullptr);
-        os.flush();
-        fstream ir_file;
-        ir_file.open("t.ll", std::fstream::out);
-        ir_file << s << std::endl;;
-        ir_file.close();
-        */
+/*
+    \brief  Генератор случайных чисел одного теста. Весь тест (граф и правила)
+            определяется только его зерном, поэтому упавший тест можно
+            повторить по зерну из failed.con.
+*/
+using Random = std::mt19937_64;
 
-        delete module;
 
-        return is_error_occur;
-    }
-};
+static cl::opt<unsigned> TestLoops(
+    "test-loops",
+    cl::desc("Percent of node insertions that make a loop (a latch back to the node)"),
+    cl::init(25));
 
 
 /*
-    \brief  Функция генерирует случайный узел и вставляет его в граф.
+    \brief  Функция генерирует случайный узел (ветвление, линейный узел
+            или цикл) и вставляет его в граф.
     \param  [in]  cgf          Граф, в который требуется добавить узел
     \param  [out] init_config  Строка, в которую записываются действия,
-                               произведенные над графом.
+                               произведенные над графом (может быть nullptr).
+    \param  [in]  rng          Генератор случайных чисел теста
 */
-void random_insert_node(ControlFlowGraph& cgf, std::string& init_config)
+void random_insert_node(ControlFlowGraph& cgf, std::string* init_config, Random& rng)
 {
-    size_t index = rand() % cgf.nodes.size();
-    bool isBranch = rand() & 1;
+    size_t index = rng() % cgf.nodes.size();
+    if(rng() % 100 < TestLoops)
+    {
+        cgf.insert_loop(index);
+        if(init_config)
+            init_config->append("loop " + to_string(index) + "\n");
+        return;
+    }
+    bool isBranch = rng() & 1;
     cgf.insert_node(index, isBranch);
 
-    init_config.append("node ");
-    init_config.append(to_string(index) + " ");
-    init_config.append(to_string(isBranch) + "\n");
+    if(!init_config)
+        return;
+    init_config->append("node ");
+    init_config->append(to_string(index) + " ");
+    init_config->append(to_string(isBranch) + "\n");
 }
 
 
@@ -341,65 +389,233 @@ void random_insert_node(ControlFlowGraph& cgf, std::string& init_config)
     \brief  Функция генерирует случайный набор правил вставки функций в граф.
     \param  [in]  cgf          Граф, для которого генерируются правила
     \param  [out] init_config  Строка, в которую записываются действия,
-                               произведенные над графом.
+                               произведенные над графом (может быть nullptr).
+    \param  [in]  rng          Генератор случайных чисел теста
     \return Вектор из набора правил для вставки функций в граф.
 */
-auto random_rules(ControlFlowGraph& cgf, std::string& init_config)
+auto random_rules(ControlFlowGraph& cgf, std::string* init_config, Random& rng)
 {
-    vector<pair<size_t, size_t>> rules;
+    vector<ControlFlowGraph::Rule> rules;
     const size_t n_nodes = cgf.nodes.size();
-    for(int i = 0; i < 2 * n_nodes; i++)
+    rules.reserve(2 * n_nodes);
+    for(size_t i = 0; i < 2 * n_nodes; i++)
     {
-        rules.push_back( {rand() % n_nodes, rand() % n_nodes} );
-        init_config.append("rule ");
-        init_config.append(to_string(rules.back().first) + " ");
-        init_config.append(to_string(rules.back().second) + "\n");
+        size_t node     = rng() % n_nodes;
+        size_t function = rng() % n_nodes;
+        auto   kind     = ControlFlowGraph::CallKind(rng() % ControlFlowGraph::N_CALL_KINDS);
+        rules.push_back({node, function, kind});
+        if(!init_config)
+            continue;
+        init_config->append("rule ");
+        init_config->append(to_string(node) + " ");
+        init_config->append(to_string(function) + " ");
+        init_config->append(to_string(kind) + "\n");
     }
     return rules;
 }
 
 
+static cl::opt<unsigned> TestWeights(
+    "test-weights",
+    cl::desc("Percent of graphs with random branch weights and function entry count"),
+    cl::init(50));
+
+
+/*
+    \brief  Функция задает случайные веса всем ветвлениям графа и счетчик
+            входов функции. Четверть ветвлений получает нулевой вес одного
+            из переходов (холодное ребро), половина графов - счетчик входов.
+    \param  [in]  cgf          Граф, ветвлениям которого задаются веса
+    \param  [out] init_config  Строка, в которую записываются действия,
+                               произведенные над графом (может быть nullptr).
+    \param  [in]  rng          Генератор случайных чисел теста
+*/
+void random_weights(ControlFlowGraph& cgf, std::string* init_config, Random& rng)
+{
+    if(rng() % 100 >= TestWeights)
+        return;
+
+    for(size_t i = 0; i < cgf.nodes.size(); i++)
+    {
+        if(cgf.nodes[i].n_child != 2)
+            continue;
+        uint32_t first  = rng() % 1000 + 1;
+        uint32_t second = rng() % 1000 + 1;
+        if(rng() % 4 == 0)
+            (rng() & 1 ? first : second) = 0;
+        cgf.set_weights(i, first, second);
+        if(init_config)
+            init_config->append("weights " + to_string(i) + " " + to_string(first) + " " +
+                                to_string(second) + "\n");
+    }
+    if(rng() & 1)
+    {
+        cgf.entry_count = rng() % 100000 + 1;
+        if(init_config)
+            init_config->append("entry_count " + to_string(cgf.entry_count) + "\n");
+    }
+}
+
+
+static cl::opt<unsigned> TestInserts(
+    "test-inserts",
+    cl::desc("Number of node insertions per graph (0 - random from 4 to 8)"), cl::init(0));
+
+
 /*
-    \brief  Функция генерирует случайный граф, затем тестирует на нем
-            оптимизационный проход.
-    \note   В случае провала теста информация о генерации графа записывается
-            в файл failed.con.
+    \brief  Функция генерирует граф и правила теста по его зерну.
+    \param  [in]  seed    Зерно теста
+    \param  [out] cgf     Граф теста
+    \param  [out] config  Действия, произведенные над графом (может быть
+                          nullptr: текст нужен только для упавших тестов)
+    \return Правила вставки функций в граф.
 */
-void test_optimization()
+auto generate_test(uint64_t seed, ControlFlowGraph& cgf, std::string* config)
+{
+    Random rng(seed);
+    size_t n_inserts = TestInserts ? TestInserts.getValue() : (rng() % 5) + 4;
+    cgf.reserve(2 * n_inserts + 2);
+    for(size_t i = 0; i < n_inserts; i++)
+        random_insert_node(cgf, config, rng);
+    random_weights(cgf, config, rng);
+    return random_rules(cgf, config, rng);
+}
+
+
+/*
+    \brief  Функция генерирует случайный граф по зерну seed, затем тестирует
+            на нем оптимизационный проход.
+    \param  [in]  seed     Зерно теста
+    \param  [in]  context  Контекст потока
+    \param  [in]  dump     Записать IR после прохода в `t.ll`
+    \return true, если найдена ошибка.
+*/
+bool test_optimization(uint64_t seed, LLVMContext& context, bool dump = false)
 {
     ControlFlowGraph cgf;
-    std::string config;
-    for(int i = 0; i < (rand() % 5) + 4; i++)
-        random_insert_node(cgf, config);
-    auto rules = random_rules(cgf, config);
-    bool is_error_occur = cgf.evaluate(rules);
-    if(!is_error_occur)
-        std::cout << "Ok ";
-    else
+    auto rules = generate_test(seed, cgf, nullptr);
+    return cgf.evaluate(rules, context, dump);
+}
+
+
+static cl::opt<unsigned> Threads(
+    "test-threads", cl::desc("Number of tester threads (0 - one per core)"), cl::init(0));
+
+static cl::opt<uint64_t> Seed(
+    "test-seed", cl::desc("Master seed, test i uses seed + i (default - from the clock)"));
+
+static cl::opt<uint64_t> Replay(
+    "test-replay", cl::desc("Rerun the single test with this seed and write its IR to t.ll"));
+
+
+/*
+    \brief  Упавшие тесты собираются в памяти и в конце одним переименованием
+            записываются в failed.con, поэтому файл никогда не бывает
+            записан наполовину и не перемешивается между потоками.
+*/
+struct Failures
+{
+    void add(uint64_t seed, const std::string& config)
     {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        std::cout << "Test failed, seed " << seed << std::endl;
+        m_failed.push_back({seed, config});
+    }
+
+    size_t size() const { return m_failed.size(); }
+
+    /* \return false, если файл записать не удалось */
+    bool write(const char* file_name)
+    {
+        std::sort(m_failed.begin(), m_failed.end());
+        std::string tmp_name = std::string(file_name) + ".tmp";
         std::fstream file;
-        file.open("failed.con", std::fstream::app);
-        file << config << std::endl;
-        std::cout << "Test failed. Inital information has wroten in failed.con" << std::endl;
+        file.open(tmp_name, std::fstream::out);
+        for(auto& failed : m_failed)
+            file << "seed " << failed.first << "\n" << failed.second << std::endl;
         file.close();
+        return file && !std::rename(tmp_name.c_str(), file_name);
     }
-}
+
+    private:
+    std::mutex m_mutex;
+    std::vector<std::pair<uint64_t, std::string>> m_failed;
+};
 
 
+/*
+    \brief  Использование: tester.out [n_tests] [-test-threads=N] [-test-seed=S] [-test-replay=S]
+                                     [опции прохода...]
+    \note   Все аргументы после числа тестов передаются в LLVM,
+            например -reg-inserter-coalesce. Тесты распределяются между
+            потоками, у каждого потока свой LLVMContext. При провале
+            зерна тестов записываются в failed.con, тест повторяется
+            запуском с -test-replay=<зерно>.
+*/
 int main(int argc, char** argv)
 {
-    int n_tests = 0;
+    uint64_t n_tests = 0;
     switch(argc)
     {
-        case 1: n_tests = 2;             break;
-        case 2: n_tests = atoi(argv[1]); break;
-        default:                         break;
-    }     
-    srand(time(0));
-
-    for(int i = 0; i < n_tests; i++)
-        test_optimization();
-    std::cout << std::endl;
-    
+        case 1:  n_tests = 2;              break;
+        default: n_tests = atoll(argv[1]); break;
+    }
+    std::vector<const char*> pass_args = {argv[0]};
+    for(int i = 2; i < argc; i++)
+        pass_args.push_back(argv[i]);
+    cl::ParseCommandLineOptions(pass_args.size(), pass_args.data());
+
+    if(Replay.getNumOccurrences())
+    {
+        LLVMContext context;
+        std::string config;
+        ControlFlowGraph cgf;
+        generate_test(Replay, cgf, &config);
+        bool is_error_occur = test_optimization(Replay, context, true);
+        std::cout << config << (is_error_occur ? "Test failed" : "Ok")
+                  << ", IR has wroten in t.ll" << std::endl;
+        return is_error_occur;
+    }
+
+    uint64_t master_seed = Seed.getNumOccurrences()
+                         ? Seed.getValue()
+                         : std::chrono::system_clock::now().time_since_epoch().count();
+    unsigned n_threads = Threads ? Threads : std::max(1u, std::thread::hardware_concurrency());
+
+    Failures failures;
+    std::atomic<uint64_t> next_test(0);
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> workers;
+    for(unsigned t = 0; t < n_threads; t++)
+        workers.emplace_back([&]()
+        {
+            LLVMContext context;
+            for(uint64_t i = next_test++; i < n_tests; i = next_test++)
+            {
+                if(!test_optimization(master_seed + i, context))
+                    continue;
+                /* текст конфигурации восстанавливается по зерну */
+                std::string config;
+                ControlFlowGraph cgf;
+                generate_test(master_seed + i, cgf, &config);
+                failures.add(master_seed + i, config);
+            }
+        });
+    for(auto& worker : workers)
+        worker.join();
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    std::cout << "Ok " << n_tests - failures.size() << ", failed " << failures.size()
+              << " (master seed " << master_seed << ", " << n_threads << " threads";
+    /* на нескольких тестах время может оказаться нулевым */
+    if(seconds > 0)
+        std::cout << ", " << uint64_t(n_tests / seconds) << " tests/s";
+    std::cout << ")" << std::endl;
+    if(failures.size())
+    {
+        if(!failures.write("failed.con"))
+            std::cerr << "failed to write failed.con" << std::endl;
+        return 1;
+    }
     return 0;
-}
\ No newline at end of file
+}
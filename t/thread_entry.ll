@@ -0,0 +1,41 @@
+; Вход test-driver: при делении на части SplitModule точка входа потока
+; @worker попадает не в ту часть, где ее передают в pthread_create (@spawn).
+; Драйвер с любым числом частей должен выдать то же, что и последовательный
+; запуск, в том числе пролог цепочки (!reg_inserter.init) у @worker и main.
+target triple = "aarch64-unknown-linux-gnu"
+
+%union.pthread_attr_t = type { i64, [7 x i64] }
+
+declare i32 @pthread_create(i64*, %union.pthread_attr_t*, i8* (i8*)*, i8*)
+declare i32 @pthread_join(i64, i8**)
+declare void @work()
+
+define i8* @worker(i8* %arg) {
+  call void @work()
+  ret i8* null
+}
+
+define void @spawn() {
+  %thread = alloca i64
+  %r = call i32 @pthread_create(i64* %thread, %union.pthread_attr_t* null, i8* (i8*)* @worker, i8* null)
+  %t = load i64, i64* %thread
+  %j = call i32 @pthread_join(i64 %t, i8** null)
+  call void @work()
+  ret void
+}
+
+define void @helper_a() {
+  call void @work()
+  ret void
+}
+
+define void @helper_b() {
+  call void @spawn()
+  ret void
+}
+
+define i32 @main() {
+  call void @helper_a()
+  call void @helper_b()
+  ret i32 0
+}